@@ -0,0 +1,280 @@
+/**
+ * @file dict_bench.cpp
+ * @brief Benchmarks of the parse and render hot paths on fixed responses
+ * @author Giuseppe Roberti <inbox> <at> <roberti> <dot> <dev>
+ */
+#include "dict.hpp"
+#include "flat_result.hpp"
+#include "markup.hpp"
+
+#include <benchmark/benchmark.h>
+
+#include <boost/log/core.hpp>
+#include <boost/log/expressions.hpp>
+
+#include <atomic>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+// count every allocation of the process, to report allocations per lookup
+
+static std::atomic<std::uint64_t> allocations{0};
+
+void* operator new (std::size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete (void* p) noexcept {
+    std::free(p);
+}
+
+void operator delete (void* p, std::size_t) noexcept {
+    std::free(p);
+}
+
+namespace logging = boost::log;
+
+namespace {
+
+namespace http = dict::http;
+namespace json = dict::json;
+
+/// A response with many entries, deeply nested senses and long texts full
+/// of tokens and characters to escape.
+std::string pathological () {
+    std::string text;
+    for (int i = 0; i < 40; ++i)
+        text += "{bc}{it}a{/it} & <b> {sx|link|id|1} {ldquo}{wi}q{/wi}{rdquo} "
+                "{a_link|word} {dx}see {dxt|other||}{/dx} {p_br} ";
+
+    std::string sense = R"j(["sense",{"sn":"1 a (1)","dt":[["text",")j" + text + R"j("]]}])j";
+    std::string pseq = "[\"pseq\",[" + sense + "," + sense + "]]";
+
+    std::string entry = R"({"meta":{"id":"x"},"hwi":{"hw":"x*y"},"def":[{"sseq":[)";
+    for (int i = 0; i < 16; ++i) {
+        if (i)
+            entry += ",";
+        entry += "[" + sense + "," + pseq + "]";
+    }
+    entry += "]}]}";
+
+    std::string doc = "[";
+    for (int i = 0; i < 64; ++i) {
+        if (i)
+            doc += ",";
+        doc += entry;
+    }
+    doc += "]";
+    return doc;
+}
+
+std::string const& fixture (std::string const& name) {
+    static std::map<std::string, std::string> fixtures;
+
+    auto it = fixtures.find(name);
+    if (it != fixtures.end())
+        return it->second;
+
+    std::string body;
+    if (name == "pathological") {
+        body = pathological();
+    } else {
+        std::ifstream in(std::string(DICT_BENCH_FIXTURES) + "/" + name + ".json");
+        if (!in)
+            throw std::runtime_error("Missing fixture " + name);
+        std::ostringstream oss;
+        oss << in.rdbuf();
+        body = oss.str();
+    }
+
+    return fixtures.emplace(name, std::move(body)).first->second;
+}
+
+/// Feed the body to a json_body::reader in chunks, like async_read does.
+json_body::value_type read_body (std::string const& body, bool streaming,
+                                 std::size_t& elements,
+                                 dict::parse_context* context = nullptr) {
+    constexpr std::size_t chunk = 4096;
+
+    http::response_header<> header;
+    json_body::value_type value;
+    value.context = context;
+    if (streaming)
+        value.on_element = [&elements](json::value&&) { ++elements; };
+
+    json_body::reader reader(header, value);
+    boost::system::error_code ec;
+    reader.init(body.size(), ec);
+
+    for (std::size_t i = 0; i < body.size() && !ec; i += chunk)
+        reader.put(boost::asio::buffer(body.data() + i,
+                                       std::min(chunk, body.size() - i)), ec);
+    if (!ec)
+        reader.finish(ec);
+    if (ec)
+        throw boost::system::system_error(ec);
+
+    return value;
+}
+
+void report (benchmark::State& state, std::size_t bytes, std::uint64_t allocs) {
+    state.SetBytesProcessed(std::int64_t(state.iterations()) * bytes);
+    state.counters["allocs/op"] = benchmark::Counter(
+                double(allocations - allocs), benchmark::Counter::kAvgIterations);
+}
+
+/// The memory a result of the fixture keeps, as charged to the result
+/// cache, to compare the DOM and the flat representations.
+void report_footprint (benchmark::State& state, std::size_t footprint) {
+    state.counters["footprint"] = benchmark::Counter(
+                double(footprint), benchmark::Counter::kDefaults,
+                benchmark::Counter::kIs1024);
+}
+
+void BM_reader (benchmark::State& state, std::string name) {
+    auto& body = fixture(name);
+    std::size_t elements = 0;
+
+    auto allocs = allocations.load();
+    for (auto _ : state)
+        benchmark::DoNotOptimize(read_body(body, false, elements));
+    report(state, body.size(), allocs);
+}
+
+void BM_reader_streaming (benchmark::State& state, std::string name) {
+    auto& body = fixture(name);
+    std::size_t elements = 0;
+
+    auto allocs = allocations.load();
+    for (auto _ : state)
+        benchmark::DoNotOptimize(read_body(body, true, elements));
+    report(state, body.size(), allocs);
+}
+
+/// Like the responses read on a kept-alive connection, that reuse its
+/// parsers and arenas.
+void BM_reader_pooled (benchmark::State& state, std::string name) {
+    auto& body = fixture(name);
+    std::size_t elements = 0;
+    dict::parse_context context;
+
+    auto allocs = allocations.load();
+    for (auto _ : state)
+        benchmark::DoNotOptimize(read_body(body, false, elements, &context));
+    report(state, body.size(), allocs);
+}
+
+void BM_result (benchmark::State& state, std::string name) {
+    auto& body = fixture(name);
+    auto const doc = json::parse(body);
+
+    std::uint64_t allocs = 0;
+    std::size_t footprint = 0;
+    for (auto _ : state) {
+        state.PauseTiming();
+        auto copy = doc;
+        auto before = allocations.load();
+        state.ResumeTiming();
+
+        dict::result r(std::move(copy));
+        benchmark::DoNotOptimize(r.entries().data());
+
+        state.PauseTiming();
+        allocs += allocations - before;
+        footprint = r.memory_footprint();
+        state.ResumeTiming();
+    }
+
+    state.counters["allocs/op"] = benchmark::Counter(
+                double(allocs), benchmark::Counter::kAvgIterations);
+    report_footprint(state, footprint);
+}
+
+void BM_flat_parse (benchmark::State& state, std::string name) {
+    auto& body = fixture(name);
+
+    std::size_t footprint = 0;
+    auto allocs = allocations.load();
+    for (auto _ : state) {
+        boost::system::error_code ec;
+        auto r = dict::flat_result::parse(body, ec);
+        benchmark::DoNotOptimize(r.view().sense_count());
+        footprint = r.memory_footprint();
+    }
+    report(state, body.size(), allocs);
+    report_footprint(state, footprint);
+}
+
+void BM_render (benchmark::State& state, std::string name) {
+    auto& body = fixture(name);
+    dict::result r(json::parse(body));
+    std::ostringstream out;
+
+    auto allocs = allocations.load();
+    for (auto _ : state) {
+        out.str({});
+        app::operator<<(out, r);
+        benchmark::DoNotOptimize(out.tellp());
+    }
+    report(state, body.size(), allocs);
+}
+
+/// What a lookup costs once the bytes are received: read, build, render.
+void BM_lookup (benchmark::State& state, std::string name) {
+    auto& body = fixture(name);
+    std::size_t elements = 0;
+    std::ostringstream out;
+
+    std::size_t footprint = 0;
+    auto allocs = allocations.load();
+    for (auto _ : state) {
+        auto value = read_body(body, false, elements);
+        dict::result r(std::move(value.json));
+        out.str({});
+        app::operator<<(out, r);
+        benchmark::DoNotOptimize(out.tellp());
+        footprint = r.memory_footprint();
+    }
+    report(state, body.size(), allocs);
+    // with its arena, like the results cached after a lookup
+    report_footprint(state, footprint);
+}
+
+#define DICT_BENCHMARK(fn)                            \
+    BENCHMARK_CAPTURE(fn, small, "small");            \
+    BENCHMARK_CAPTURE(fn, typical, "typical");        \
+    BENCHMARK_CAPTURE(fn, pathological, "pathological")
+
+DICT_BENCHMARK(BM_reader);
+DICT_BENCHMARK(BM_reader_streaming);
+DICT_BENCHMARK(BM_reader_pooled);
+DICT_BENCHMARK(BM_result);
+DICT_BENCHMARK(BM_flat_parse);
+DICT_BENCHMARK(BM_render);
+DICT_BENCHMARK(BM_lookup);
+
+} // namespace
+
+int main (int argc, char** argv) {
+    // the trace logs would dominate every measure
+    logging::core::get()->set_filter
+    (
+        logging::trivial::severity >=
+                logging::trivial::severity_level::error
+    );
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+        return 1;
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
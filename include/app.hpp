@@ -7,89 +7,185 @@
 #define APP_HPP
 
 #include "dict.hpp"
+#include "markup.hpp"
 
 #include <boost/log/trivial.hpp>
 
 #include <gtkmm.h>
 
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <memory>
+#include <optional>
 #include <ostream>
-#include <future>
-#include <thread>
-
-#include <iomanip>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
 
 namespace logging = boost::log;
 
 namespace app {
 
-std::ostream& operator<< (std::ostream& out, dict::sense const& s) {
-    Glib::ustring text = s.get_text().c_str();
+/// A row of the ResultView: either the header of an entry or a sense.
+/// It only points to the text, that is owned by the result it comes from,
+/// but for the headword of an entry, that is stripped of its marks.
+class ResultRow : public Glib::Object {
+private:
+    std::shared_ptr<const void> m_owner;
+    bool m_entry;
+    std::string m_headword;
+    std::string_view m_fl;
+    const char* m_type;
+    std::optional<std::string_view> m_sn;
+    std::string_view m_text;
+
+public:
+    template<class Entry>
+    static Glib::RefPtr<ResultRow> create_entry (std::shared_ptr<const void> owner,
+                                                 Entry const& e) {
+        auto row = Glib::make_refptr_for_instance<ResultRow>(
+                    new ResultRow(std::move(owner), true, "", std::nullopt, {}));
+        row->m_headword = e.get_headword();
+        row->m_fl = e.get_fl();
+        return row;
+    }
 
-    auto regexes = {
-        Glib::Regex::create("\\{bc\\}"),
-        Glib::Regex::create("\\{sx\\|(.+)\\|\\|\\}")
-    };
+    template<class Sense>
+    static Glib::RefPtr<ResultRow> create_sense (std::shared_ptr<const void> owner,
+                                                 Sense const& s) {
+        return Glib::make_refptr_for_instance<ResultRow>(
+                    new ResultRow(std::move(owner), false, s.get_type(),
+                                  s.get_sn(), s.get_text()));
+    }
 
-    auto replaces = {
-        Glib::UStringView("<b><tt> : </tt></b>"),
-        Glib::UStringView("SEE \\1")
-    };
+    bool is_entry () const { return m_entry; }
+    std::string_view get_headword () const { return m_headword; }
+    std::string_view get_fl () const { return m_fl; }
+    const char* get_type () const { return m_type; }
+    std::optional<std::string_view> get_sn () const { return m_sn; }
+    std::string_view get_text () const { return m_text; }
 
-    decltype(regexes)::const_iterator regex = regexes.begin();
-    decltype(replaces)::const_iterator replace = replaces.begin();
+protected:
+    ResultRow (std::shared_ptr<const void> owner, bool entry, const char* type,
+               std::optional<std::string_view> sn, std::string_view text):
+        m_owner(std::move(owner))
+      , m_entry(entry), m_type(type), m_sn(sn), m_text(text)
+    {}
+};
 
-    while (regex != regexes.end() && replace != replaces.end()) {
-        text = (*regex)->replace(text.c_str(), text.length(), 0, *replace);
+/// Only the visible rows get a widget, and their markup is rendered when
+/// they are bound, so the cost of a result does not depend on its size.
+class ResultView : public Gtk::ListView {
+private:
+    Glib::RefPtr<Gio::ListStore<ResultRow>> m_rows;
+    Glib::RefPtr<Gtk::SignalListItemFactory> m_factory;
 
-        ++regex;
-        ++replace;
+public:
+    ResultView ():
+        m_rows(Gio::ListStore<ResultRow>::create())
+      , m_factory(Gtk::SignalListItemFactory::create())
+    {
+        set_margin_start(42);
+        set_margin_end(42);
+
+        m_factory->signal_setup().connect(
+                    [](const Glib::RefPtr<Gtk::ListItem>& item) {
+            auto label = Gtk::make_managed<Gtk::Label>();
+            label->set_wrap();
+            label->set_wrap_mode(Pango::WrapMode::WORD);
+            label->set_xalign(0);
+            item->set_child(*label);
+        });
+
+        m_factory->signal_bind().connect(
+                    [](const Glib::RefPtr<Gtk::ListItem>& item) {
+            auto row = std::dynamic_pointer_cast<ResultRow>(item->get_item());
+            auto label = dynamic_cast<Gtk::Label*>(item->get_child());
+            if (!row || !label)
+                return;
+
+            DICT_TRACE_SCOPE("render.row");
+            auto& buf = markup::buffer();
+            if (row->is_entry())
+                markup::render_entry(buf, *row);
+            else
+                markup::render_sense(buf, *row);
+            label->set_markup(buf);
+        });
+
+        set_model(Gtk::NoSelection::create(m_rows));
+        set_factory(m_factory);
     }
 
-    out << "<b><tt>"
-        << std::setfill(' ') << std::setw(8)
-        << (s.get_sn().has_value() ? s.get_sn().value().get().c_str() : "")
-        << "</tt></b>"
-        << text.c_str() << " "
-        << "(" << s.get_type() << ")";
+    void set_result (dict::api::result_ptr const& result) {
+        replace_rows(result);
+    }
 
-    return out;
-}
+    /// The rows point into the mapped file, that they keep alive.
+    void set_result (dict::compiled_result const& result) {
+        replace_rows(result);
+    }
 
-std::ostream& operator<< (std::ostream& out, dict::entry const& e) {
-    for (auto& sense : e.senses())
-        out << sense << "\n";
-    return out;
-}
+    void clear () {
+        m_rows->remove_all();
+        if (auto adjustment = get_vadjustment())
+            adjustment->set_value(0);
+    }
 
-std::ostream& operator<< (std::ostream& out, dict::result const& r) {
-    for (auto& entry : r.entries())
-        out << "\n" << entry;
+    /// Add the entries of a result after the ones already shown.
+    void append_result (dict::api::result_ptr const& result) {
+        dict::stopwatch watch;
+        auto rows = make_rows(result);
 
-    return out;
-}
+        m_rows->splice(m_rows->get_n_items(), 0, rows);
+        watch.lap(dict::phase::render);
+
+        BOOST_LOG_TRIVIAL(trace)
+                << "Result view has " << m_rows->get_n_items() << " rows";
+    }
 
-class ResultView : public Gtk::Label {
 private:
-    Glib::ustring m_markup;
+    template<class Result>
+    void replace_rows (Result const& result) {
+        dict::stopwatch watch;
+        auto rows = make_rows(result);
 
-public:
-    ResultView () {
-        set_margin_start(42);
-        set_margin_end(42);
-        set_wrap();
-        set_wrap_mode(Pango::WrapMode::WORD);
-        get_layout()->set_alignment(Pango::Alignment::RIGHT);
+        m_rows->splice(0, m_rows->get_n_items(), rows);
+        if (auto adjustment = get_vadjustment())
+            adjustment->set_value(0);
+        watch.lap(dict::phase::render);
+
+        BOOST_LOG_TRIVIAL(trace)
+                << "Result view has " << rows.size() << " rows";
     }
 
-    void set_result (dict::result const& result) {
-        std::ostringstream oss;
-        oss << result;
-        m_markup = oss.str();
-        set_markup(m_markup);
+    static std::vector<Glib::RefPtr<ResultRow>> make_rows (
+            dict::api::result_ptr const& result) {
+        std::vector<Glib::RefPtr<ResultRow>> rows;
 
-        BOOST_LOG_TRIVIAL(trace)
-                << "Pango markup is\n"
-                << m_markup;
+        for (auto& entry : result->entries()) {
+            rows.push_back(ResultRow::create_entry(result, entry));
+            for (auto& sense : entry.senses())
+                rows.push_back(ResultRow::create_sense(result, sense));
+        }
+
+        return rows;
+    }
+
+    static std::vector<Glib::RefPtr<ResultRow>> make_rows (
+            dict::compiled_result const& result) {
+        std::vector<Glib::RefPtr<ResultRow>> rows;
+
+        for (std::size_t i = 0; i < result.size(); ++i) {
+            auto entry = result[i];
+            rows.push_back(ResultRow::create_entry(result.owner(), entry));
+            for (std::size_t j = 0; j < entry.size(); ++j)
+                rows.push_back(ResultRow::create_sense(result.owner(), entry[j]));
+        }
+
+        return rows;
     }
 };
 
@@ -109,6 +205,10 @@ private:
     Glib::RefPtr<Gio::SimpleAction> m_action;
     Gtk::PopoverMenu m_popover;
 
+    // completions are shown while typing, so they must not take the focus
+    Gtk::Popover m_completions;
+    Gtk::ListBox m_completion_list;
+
 public:
     Search():
         m_menu(Gio::Menu::create())
@@ -118,6 +218,21 @@ public:
 
         m_popover.set_menu_model(m_menu);
         m_popover.set_parent(*this);
+
+        m_completion_list.set_selection_mode(Gtk::SelectionMode::NONE);
+        m_completion_list.set_activate_on_single_click();
+        m_completion_list.signal_row_activated().connect(
+                    [this](Gtk::ListBoxRow* row) {
+            if (auto label = dynamic_cast<Gtk::Label*>(row->get_child()))
+                m_action->activate(
+                            Glib::Variant<Glib::ustring>::create(label->get_text()));
+        });
+
+        m_completions.set_child(m_completion_list);
+        m_completions.set_autohide(false);
+        m_completions.set_has_arrow(false);
+        m_completions.set_position(Gtk::PositionType::BOTTOM);
+        m_completions.set_parent(*this);
     }
 
     auto signal_term_selected () {
@@ -132,18 +247,58 @@ public:
     }
 #endif
 
-    void set_suggestions (dict::suggestions const& suggestions) {
+    /// Terms to choose from, eg: the dict::suggestions for a term not found.
+    void set_suggestions (std::vector<std::string> const& suggestions) {
         m_menu->remove_all();
         for (auto & s : suggestions) {
           m_menu->append(s, "app.define::" + s);
         }
         m_popover.popup();
     }
+
+    void set_completions (std::vector<std::string> const& terms) {
+        while (auto row = m_completion_list.get_row_at_index(0))
+            m_completion_list.remove(*row);
+
+        if (terms.empty())
+            return hide_completions();
+
+        for (auto& term : terms) {
+            auto label = Gtk::make_managed<Gtk::Label>(term);
+            label->set_xalign(0);
+            m_completion_list.append(*label);
+        }
+        m_completions.popup();
+    }
+
+    void hide_completions () {
+        m_completions.popdown();
+    }
 };
 
 class Layout : public Gtk::Box {
 private:
     Gtk::Window& m_window;
+
+    std::mutex m_done_mutex;
+    std::deque<std::function<void()>> m_done;
+    Glib::Dispatcher m_req_done;
+    std::uint64_t m_req_id = 0;
+    // the last request whose entries are being shown as they arrive
+    std::uint64_t m_streamed_id = 0;
+
+    // search as you type: the term is looked up once the user stops
+    // typing for m_debounce_ms (0 means only when enter is pressed)
+    unsigned m_debounce_ms;
+    sigc::connection m_debounce;
+    Glib::ustring m_term;
+    std::shared_ptr<boost::asio::cancellation_signal> m_cancel;
+
+    static constexpr std::size_t max_completions = 8;
+    static constexpr std::size_t max_matches = 20;
+
+    // declared after the queue of completions, so that it is destroyed
+    // (and its thread joined) before them
     dict::api m_api;
 
     Search m_search;
@@ -154,17 +309,15 @@ private:
     Gtk::ScrolledWindow m_scroll;
 
     Gtk::Statusbar m_status;
+    guint m_metrics_msg = 0;
     std::unique_ptr<Gtk::MessageDialog> m_error_dialog;
 
-    guint m_req_msg_id;
-    std::optional<std::thread> m_req_thr;
-    std::future<std::unique_ptr<dict::result>> m_req_ftr;
-    Glib::Dispatcher m_req_done;
-
 public:
     Layout (Gtk::Window& window) : Box(Gtk::Orientation::VERTICAL)
       , m_window(window)
-      , m_api(Glib::getenv("DICTIONARY_API_KEY"))
+      , m_debounce_ms(debounce_from_env())
+      , m_api(Glib::getenv("DICTIONARY_API_KEY"),
+              dict::api_options::from_env())
     {
         /// HEADER WIDGETS
 
@@ -203,7 +356,30 @@ private:
             BOOST_LOG_TRIVIAL(trace)
                     << "User entered search term <"
                     << m_search.get_text() << ">";
-            define(m_search.get_text());
+            m_debounce.disconnect();
+            m_search.hide_completions();
+            define(m_search.get_text(), true);
+        });
+
+        m_search.signal_changed().connect([this]{
+            // known terms are completed at once, without any lookup
+            auto text = m_search.get_text();
+            m_search.set_completions(text.empty()
+                    ? std::vector<std::string>()
+                    : m_api.complete(text.raw(), max_completions));
+
+            m_debounce.disconnect();
+            if (m_debounce_ms == 0)
+                return;
+            m_debounce = Glib::signal_timeout().connect([this]{
+                // not when the text was set by selecting a suggestion,
+                // nor for searches of the definitions, that are only
+                // done when enter is pressed
+                if (m_search.get_text() != m_term
+                        && !definition_query(m_search.get_text()))
+                    define(m_search.get_text(), false);
+                return false;
+            }, m_debounce_ms);
         });
 
         m_search.signal_term_selected().connect(
@@ -215,75 +391,191 @@ private:
             ustring text =
                     VariantBase::cast_dynamic<Variant<ustring>>(parameter).get();
             m_search.set_text(text);
-            define(text);
+            m_search.hide_completions();
+            define(text, true);
         });
 
         m_req_done.connect([this]{
-            BOOST_LOG_TRIVIAL(trace) << "Search done!";
-
-            m_req_thr->join();
-            m_req_thr.reset();
-
-            try {
-                auto const& result = m_req_ftr.get();
-                m_result_view.set_result(*result);
-            } catch (dict::suggestions const& suggestions) {
-                m_search.set_suggestions(suggestions);
-            } catch (std::exception const& e) {
-                std::ostringstream oss;
-                oss << e.what();
-                m_error_dialog.reset(new Gtk::MessageDialog(
-                                         m_window,
-                                         oss.str(),
-                                         true,
-                                         Gtk::MessageType::ERROR));
-                m_error_dialog->set_modal();
-                m_error_dialog->show();
-                m_error_dialog->signal_response().connect([this](int response_id){
-                    m_search.set_text("");
-                    m_error_dialog->hide();
-                });
+            std::deque<std::function<void()>> done;
+            {
+                std::lock_guard<std::mutex> lock(m_done_mutex);
+                done.swap(m_done);
             }
-
-            m_search.set_sensitive();
-            m_status.remove_message(m_req_msg_id);
+            for (auto& fn : done)
+                fn();
         });
     }
 
-    void define (Glib::ustring const& term) {
+    /// Run fn on the GTK main loop; safe to call from any thread.
+    void post (std::function<void()> fn) {
+        {
+            std::lock_guard<std::mutex> lock(m_done_mutex);
+            m_done.push_back(std::move(fn));
+        }
+        m_req_done.emit();
+    }
+
+    /// Look up a term; only an explicit search (not one started while
+    /// typing) pops up the suggestions when it is not found.
+    void define (Glib::ustring const& term, bool explicit_search) {
+        // whatever is still running is not needed anymore
+        cancel_request();
+
+        m_term = term;
         if (term.empty()) return;
 
-        m_search.set_sensitive(false);
+        auto req_id = ++m_req_id;
+
+        // "def: words" lists the terms whose definitions have the words
+        if (auto query = definition_query(term)) {
+            std::vector<std::string> terms;
+            for (auto& hit : m_api.search_definitions(*query, max_matches))
+                terms.push_back(std::move(hit.term));
+            if (terms.empty()) {
+                auto msg_id = m_status.push("No definition has " + *query);
+                Glib::signal_timeout().connect_once([this, msg_id]{
+                    m_status.remove_message(msg_id);
+                }, 2500);
+            } else {
+                m_search.set_suggestions(terms);
+            }
+            return;
+        }
 
-        m_req_msg_id = m_status.push("Searching " + term + " ...");
+        // a term of the compiled dictionary is shown at once, unless the
+        // entries of other references are merged with it
+        if (auto compiled = m_api.references().size() == 1
+                ? m_api.lookup_compiled(term.raw()) : std::nullopt) {
+            m_result_view.set_result(*compiled);
+            show_metrics();
+            return;
+        }
+
+        auto msg_id = m_status.push("Searching " + term + " ...");
 
         BOOST_LOG_TRIVIAL(trace)
                 << "Starting search for term <" << term << ">";
 
-        std::promise<std::unique_ptr<dict::result>> prm;
-        m_req_ftr = prm.get_future();
-        m_req_thr = std::thread(
-                    [this, term]
-                    (std::promise<std::unique_ptr<dict::result>>&& prm)
+        auto on_entry = [this, req_id](dict::api::result_ptr entry) {
+            post([this, req_id, entry]{
+                show_entry(req_id, entry);
+            });
+        };
+
+        auto cancel = std::make_shared<boost::asio::cancellation_signal>();
+        m_cancel = cancel;
+
+        m_api.async_request(term, on_entry,
+                    boost::asio::bind_cancellation_slot(cancel->slot(),
+                    // the signal must outlive the lookup
+                    [this, req_id, explicit_search, msg_id, term, cancel]
+                    (std::exception_ptr e, dict::api::result_ptr result)
         {
             BOOST_LOG_TRIVIAL(trace)
-                    << "Search for term <" << term << "> started";
+                    << "Search for term <" << term << "> finished";
+
+            post([this, req_id, explicit_search, msg_id, e, result]{
+                m_status.remove_message(msg_id);
+                show(req_id, explicit_search, e, result);
+                show_metrics();
+            });
+        }));
+    }
+
+    void cancel_request () {
+        if (!m_cancel)
+            return;
+
+        // its completion is not shown, whatever it is
+        ++m_req_id;
+
+        // the signal is emitted on the api thread, like the lookup runs
+        boost::asio::post(m_api.get_executor(), [cancel = std::move(m_cancel)]{
+            cancel->emit(boost::asio::cancellation_type::terminal);
+        });
+        m_cancel.reset();
+    }
+
+    /// The words after the "def:" prefix, if the term has it.
+    static std::optional<std::string> definition_query (Glib::ustring const& term) {
+        static constexpr std::string_view prefix = "def:";
+        std::string_view text = term.raw();
+        if (text.substr(0, prefix.size()) != prefix)
+            return std::nullopt;
+        return std::string(text.substr(prefix.size()));
+    }
 
-            try {
-                BOOST_LOG_TRIVIAL(trace)
-                        << "Search for term <" << term << "> finished";
+    static unsigned debounce_from_env () {
+        auto ms = Glib::getenv("DICTIONARY_DEBOUNCE_MS");
+        return ms.empty() ? 300 : std::strtoul(ms.c_str(), nullptr, 10);
+    }
+
+    /// A summary of the lookup latency, in place of the previous one.
+    void show_metrics () {
+        if (m_metrics_msg)
+            m_status.remove_message(m_metrics_msg);
+        m_metrics_msg = m_status.push(m_api.lookup_metrics().summary());
+    }
 
-                auto result = m_api.request(term);
+    void show_entry (std::uint64_t req_id, dict::api::result_ptr const& entry) {
+        if (req_id != m_req_id) return;
+
+        // the first entry replaces the previous result
+        if (m_streamed_id != req_id) {
+            m_streamed_id = req_id;
+            m_result_view.clear();
+        }
+        m_result_view.append_result(entry);
+    }
 
-                prm.set_value(std::move(result));
-            } catch (...) {
-                BOOST_LOG_TRIVIAL(trace)
-                        << "Search for term <" << term << "> throws";
-                prm.set_exception(std::current_exception());
+    void show (std::uint64_t req_id, bool explicit_search, std::exception_ptr e,
+               dict::api::result_ptr const& result) {
+        // a newer search was started in the meanwhile, or it was cancelled
+        if (req_id != m_req_id) return;
+
+        BOOST_LOG_TRIVIAL(trace) << "Search done!";
+
+        try {
+            if (e)
+                std::rethrow_exception(e);
+            // even when its entries were shown as they arrived: the merged
+            // result is in the order of the references, has the entries that
+            // did not stream (eg: cached or compiled) and not the ones of a
+            // reference that missed its deadline
+            if (result)
+                m_result_view.set_result(result);
+        } catch (dict::suggestions const& suggestions) {
+            // the popover takes the focus, it must not interrupt typing
+            if (explicit_search) {
+                m_search.set_suggestions(suggestions);
+            } else {
+                auto msg_id = m_status.push("Not found, press enter for suggestions");
+                Glib::signal_timeout().connect_once([this, msg_id]{
+                    m_status.remove_message(msg_id);
+                }, 2500);
             }
+        } catch (boost::system::system_error const& e) {
+            if (e.code() != boost::asio::error::operation_aborted)
+                show_error(e);
+        } catch (std::exception const& e) {
+            show_error(e);
+        }
+    }
 
-            m_req_done.emit();
-        }, std::move(prm));
+    void show_error (std::exception const& e) {
+        std::ostringstream oss;
+        oss << e.what();
+        m_error_dialog.reset(new Gtk::MessageDialog(
+                                 m_window,
+                                 oss.str(),
+                                 true,
+                                 Gtk::MessageType::ERROR));
+        m_error_dialog->set_modal();
+        m_error_dialog->show();
+        m_error_dialog->signal_response().connect([this](int response_id){
+            m_search.set_text("");
+            m_error_dialog->hide();
+        });
     }
 };
 
@@ -0,0 +1,188 @@
+/**
+ * @file arena.hpp
+ * @brief Arenas for parsed responses, recycled across the requests of a connection
+ * @author Giuseppe Roberti <inbox> <at> <roberti> <dot> <dev>
+ */
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include <boost/json.hpp>
+#include <boost/json/monotonic_resource.hpp>
+#include <boost/json/stream_parser.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace dict {
+
+namespace json = boost::json;
+
+struct arena_stats {
+    std::uint64_t reused = 0;       ///< arenas on a recycled buffer
+    std::uint64_t allocated = 0;    ///< arenas on a new buffer
+    std::size_t expected = 0;       ///< bytes expected for the next response
+};
+
+class arena_pool;
+
+/// A monotonic resource over a buffer of an arena_pool: nothing is freed
+/// until the arena is destroyed, when the last value allocated in it
+/// goes away, and then the buffer goes back to the pool.
+class arena : public json::memory_resource {
+public:
+    struct buffer {
+        std::unique_ptr<unsigned char[]> data;
+        std::size_t size = 0;
+    };
+
+private:
+    std::weak_ptr<arena_pool> m_pool;
+    buffer m_buffer;
+    json::monotonic_resource m_resource;
+    std::atomic<std::size_t> m_used{0};
+
+public:
+    arena (std::weak_ptr<arena_pool> pool, buffer buf):
+        m_pool(std::move(pool))
+      , m_buffer(std::move(buf))
+      , m_resource(m_buffer.data.get(), m_buffer.size)
+    {}
+
+    ~arena ();
+
+    /// Bytes allocated so far, in the buffer or beyond it.
+    std::size_t used () const {
+        return m_used.load(std::memory_order_relaxed);
+    }
+
+    /// Bytes of memory the arena holds, about: its buffer, or what was
+    /// allocated if it did not fit.
+    std::size_t reserved () const {
+        return std::max(m_buffer.size, used());
+    }
+
+protected:
+    void* do_allocate (std::size_t bytes, std::size_t align) override {
+        m_used.fetch_add(bytes, std::memory_order_relaxed);
+        return m_resource.allocate(bytes, align);
+    }
+
+    void do_deallocate (void*, std::size_t, std::size_t) override {}
+
+    bool do_is_equal (json::memory_resource const& other) const noexcept override {
+        return this == &other;
+    }
+};
+
+/// Buffers for the arenas, sized after an exponentially weighted moving
+/// average of the bytes the recent responses took, and kept for reuse.
+class arena_pool : public std::enable_shared_from_this<arena_pool> {
+private:
+    static constexpr std::size_t page = 4096;
+    static constexpr std::size_t min_size = 4 * page;
+    static constexpr std::size_t max_size = 4 << 20;
+    static constexpr std::size_t max_free = 4;
+
+    mutable std::mutex m_mutex;
+    std::vector<arena::buffer> m_free;
+    double m_average = min_size;
+    std::uint64_t m_reused = 0, m_allocated = 0;
+
+public:
+    /// An arena for the next response; size_hint (eg: its Content-Length)
+    /// is only used when larger than the average.
+    json::storage_ptr acquire (std::size_t size_hint = 0) {
+        arena::buffer buf;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+
+            auto size = std::clamp<std::size_t>(
+                        std::max<std::size_t>(size_hint, m_average * 1.25),
+                        min_size, max_size);
+            size = (size + page - 1) / page * page;
+
+            // the smallest free buffer that is large enough
+            auto it = m_free.end();
+            for (auto i = m_free.begin(); i != m_free.end(); ++i)
+                if (i->size >= size && (it == m_free.end() || i->size < it->size))
+                    it = i;
+
+            if (it != m_free.end()) {
+                ++m_reused;
+                buf = std::move(*it);
+                m_free.erase(it);
+            } else {
+                ++m_allocated;
+                buf.data.reset(new unsigned char[size]);
+                buf.size = size;
+            }
+        }
+
+        return json::make_shared_resource<arena>(weak_from_this(), std::move(buf));
+    }
+
+    /// Account for the bytes taken by a response, once parsed.
+    void record (std::size_t used) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_average += (static_cast<double>(used) - m_average) / 8;
+    }
+
+    void recycle (arena::buffer buf) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        // keep the largest buffers
+        if (m_free.size() == max_free) {
+            auto smallest = std::min_element(m_free.begin(), m_free.end(),
+                    [](auto const& a, auto const& b) { return a.size < b.size; });
+            if (smallest->size >= buf.size)
+                return;
+            m_free.erase(smallest);
+        }
+        m_free.push_back(std::move(buf));
+    }
+
+    arena_stats stats () const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        arena_stats s;
+        s.reused = m_reused;
+        s.allocated = m_allocated;
+        s.expected = static_cast<std::size_t>(m_average);
+        return s;
+    }
+};
+
+inline arena::~arena () {
+    // whatever was allocated beyond the buffer is freed now
+    m_resource.release();
+    if (auto pool = m_pool.lock())
+        pool->recycle(std::move(m_buffer));
+}
+
+/// What the response path keeps across the requests of a connection: the
+/// parsers, that keep their internal buffers, and the pool of arenas the
+/// responses are parsed into.
+struct parse_context {
+    json::stream_parser parser;
+    json::stream_parser element;
+    std::shared_ptr<arena_pool> arenas = std::make_shared<arena_pool>();
+};
+
+} // namespace dict
+
+namespace boost {
+namespace json {
+
+// values in an arena are never freed one by one
+template<>
+struct is_deallocate_trivial<dict::arena> {
+    static constexpr bool value = true;
+};
+
+} // namespace json
+} // namespace boost
+
+#endif // ARENA_HPP
@@ -0,0 +1,510 @@
+/**
+ * @file compiled_dict.hpp
+ * @brief Read-only, memory-mapped dictionary indexed by a minimal perfect hash
+ * @author Giuseppe Roberti <inbox> <at> <roberti> <dot> <dev>
+ */
+#ifndef COMPILED_DICT_HPP
+#define COMPILED_DICT_HPP
+
+#include <boost/log/trivial.hpp>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <numeric>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace dict {
+
+/// The file is a header followed by arrays of fixed size records and by a
+/// pool of strings they point into: terms (in the order of their slot in
+/// the perfect hash) refer to a range of entry indices, so that an entry
+/// can be shared by many terms, entries own a range of senses and senses
+/// own their number and text. Nothing is parsed when it is opened.
+struct compiled_span {
+    static constexpr std::uint32_t npos = std::uint32_t(-1);
+
+    std::uint32_t offset = npos;
+    std::uint32_t size = 0;
+
+    bool empty () const {
+        return offset == npos;
+    }
+};
+
+struct compiled_term {
+    compiled_span key;
+    std::uint32_t first_ref;
+    std::uint32_t ref_count;
+};
+
+struct compiled_entry {
+    compiled_span headword;
+    compiled_span fl;
+    std::uint32_t first_sense;
+    std::uint32_t sense_count;
+};
+
+struct compiled_sense {
+    std::uint32_t type;     ///< a dict::sense::type
+    compiled_span sn;
+    compiled_span text;
+};
+
+struct compiled_header {
+    char magic[8];
+    std::uint64_t seed;
+    std::uint64_t pool_size;
+    std::uint32_t term_count;
+    std::uint32_t bucket_count;
+    std::uint32_t ref_count;
+    std::uint32_t entry_count;
+    std::uint32_t sense_count;
+    std::uint32_t reserved;
+};
+
+/// CHD, "hash, displace and compress" without the compression: the keys
+/// are split into buckets by a first hash, then, largest bucket first,
+/// every bucket gets the smallest displacement that sends all of its keys
+/// to free slots. With as many slots as keys the hash is minimal, and a
+/// lookup is a hash, a load of the displacement and a mix.
+class perfect_hash {
+public:
+    static constexpr std::uint32_t keys_per_bucket = 4;
+
+    static std::uint64_t hash (std::string_view key, std::uint64_t seed) {
+        // FNV-1a, then the finalizer of MurmurHash3 to spread its bits
+        std::uint64_t h = 14695981039346656037ull ^ seed;
+        for (unsigned char c : key)
+            h = (h ^ c) * 1099511628211ull;
+        return mix(h);
+    }
+
+    static std::uint32_t bucket_count (std::size_t keys) {
+        return std::max<std::size_t>(1, (keys + keys_per_bucket - 1) / keys_per_bucket);
+    }
+
+    static std::uint32_t bucket (std::uint64_t h, std::uint32_t buckets) {
+        return (h >> 32) % buckets;
+    }
+
+    static std::uint32_t slot (std::uint64_t h, std::uint32_t displacement,
+                               std::uint32_t slots) {
+        return mix(h + displacement * 0x9e3779b97f4a7c15ull) % slots;
+    }
+
+    /// The displacement of every bucket for a set of hashes, or false if
+    /// there is none (eg: two equal hashes): then try another seed.
+    static bool build (std::vector<std::uint64_t> const& hashes,
+                       std::vector<std::uint32_t>& displacements) {
+        std::uint32_t n = hashes.size();
+        auto buckets = bucket_count(n);
+        displacements.assign(buckets, 0);
+
+        // the keys grouped by bucket, the largest buckets first
+        std::vector<std::uint32_t> keys(n);
+        std::iota(keys.begin(), keys.end(), 0);
+        std::vector<std::uint32_t> sizes(buckets, 0);
+        for (auto h : hashes)
+            ++sizes[bucket(h, buckets)];
+        std::sort(keys.begin(), keys.end(), [&](std::uint32_t a, std::uint32_t b) {
+            auto ba = bucket(hashes[a], buckets), bb = bucket(hashes[b], buckets);
+            return sizes[ba] != sizes[bb] ? sizes[ba] > sizes[bb] : ba < bb;
+        });
+
+        std::vector<bool> taken(n, false);
+        std::vector<std::uint32_t> slots;
+        const std::uint64_t max_tries = std::uint64_t(n) * 64 + 1024;
+
+        for (std::size_t i = 0; i < keys.size();) {
+            auto b = bucket(hashes[keys[i]], buckets);
+            auto end = i + sizes[b];
+
+            bool placed = false;
+            for (std::uint64_t d = 0; d < max_tries && !placed; ++d) {
+                slots.clear();
+                placed = true;
+                for (auto j = i; j < end && placed; ++j) {
+                    auto s = slot(hashes[keys[j]], d, n);
+                    placed = !taken[s]
+                            && std::find(slots.begin(), slots.end(), s) == slots.end();
+                    slots.push_back(s);
+                }
+                if (placed) {
+                    displacements[b] = d;
+                    for (auto s : slots)
+                        taken[s] = true;
+                }
+            }
+            if (!placed)
+                return false;
+            i = end;
+        }
+        return true;
+    }
+
+private:
+    static std::uint64_t mix (std::uint64_t h) {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ull;
+        h ^= h >> 33;
+        return h;
+    }
+};
+
+namespace detail {
+
+inline constexpr char compiled_magic[8] = {'D', 'I', 'C', 'T', 'C', 'D', '0', '2'};
+
+/// Offsets of the arrays that follow the header, each aligned to 8 bytes.
+struct compiled_layout {
+    std::uint64_t displacements, terms, refs, entries, senses, pool, size;
+
+    explicit compiled_layout (compiled_header const& h) {
+        auto align = [](std::uint64_t n) { return (n + 7) & ~std::uint64_t(7); };
+        displacements = align(sizeof(compiled_header));
+        terms = align(displacements + std::uint64_t(h.bucket_count) * sizeof(std::uint32_t));
+        refs = align(terms + std::uint64_t(h.term_count) * sizeof(compiled_term));
+        entries = align(refs + std::uint64_t(h.ref_count) * sizeof(std::uint32_t));
+        senses = align(entries + std::uint64_t(h.entry_count) * sizeof(compiled_entry));
+        pool = align(senses + std::uint64_t(h.sense_count) * sizeof(compiled_sense));
+        size = pool + h.pool_size;
+    }
+};
+
+} // namespace detail
+
+/// A compiled dictionary, mapped read only: terms are found with a single
+/// probe of the perfect hash, and their records and strings are read in
+/// place. Every member is safe to call from any thread.
+class compiled_dict {
+private:
+    int m_fd = -1;
+    const char* m_map = nullptr;
+    std::size_t m_map_size = 0;
+
+    compiled_header m_header{};
+    std::uint32_t const* m_displacements = nullptr;
+    compiled_term const* m_terms = nullptr;
+    std::uint32_t const* m_refs = nullptr;
+    compiled_entry const* m_entries = nullptr;
+    compiled_sense const* m_senses = nullptr;
+    const char* m_pool = nullptr;
+
+public:
+    explicit compiled_dict (std::string const& path) {
+        m_fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (m_fd < 0) {
+            BOOST_LOG_TRIVIAL(error)
+                    << "Unable to open compiled dictionary " << path
+                    << ": " << std::strerror(errno);
+            return;
+        }
+
+        struct stat st;
+        if (::fstat(m_fd, &st) != 0 || st.st_size < off_t(sizeof m_header)) {
+            BOOST_LOG_TRIVIAL(error)
+                    << "Invalid compiled dictionary " << path;
+            close();
+            return;
+        }
+
+        void* map = ::mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, m_fd, 0);
+        if (map == MAP_FAILED) {
+            BOOST_LOG_TRIVIAL(error)
+                    << "Unable to map compiled dictionary " << path
+                    << ": " << std::strerror(errno);
+            close();
+            return;
+        }
+        m_map = static_cast<const char*>(map);
+        m_map_size = st.st_size;
+
+        // lookups probe it at random
+        ::madvise(map, m_map_size, MADV_RANDOM);
+
+        std::memcpy(&m_header, m_map, sizeof m_header);
+        detail::compiled_layout layout(m_header);
+        if (std::memcmp(m_header.magic, detail::compiled_magic, sizeof m_header.magic) != 0
+                || layout.size != m_map_size
+                || m_header.bucket_count == 0) {
+            BOOST_LOG_TRIVIAL(error)
+                    << "Invalid compiled dictionary " << path;
+            close();
+            return;
+        }
+
+        m_displacements = reinterpret_cast<std::uint32_t const*>(m_map + layout.displacements);
+        m_terms = reinterpret_cast<compiled_term const*>(m_map + layout.terms);
+        m_refs = reinterpret_cast<std::uint32_t const*>(m_map + layout.refs);
+        m_entries = reinterpret_cast<compiled_entry const*>(m_map + layout.entries);
+        m_senses = reinterpret_cast<compiled_sense const*>(m_map + layout.senses);
+        m_pool = m_map + layout.pool;
+
+        BOOST_LOG_TRIVIAL(trace)
+                << "Compiled dictionary " << path << " has "
+                << m_header.term_count << " terms";
+    }
+
+    compiled_dict (compiled_dict const&) = delete;
+    compiled_dict& operator= (compiled_dict const&) = delete;
+
+    ~compiled_dict () {
+        close();
+    }
+
+    bool is_open () const {
+        return m_map != nullptr;
+    }
+
+    /// Number of terms.
+    std::size_t size () const {
+        return m_header.term_count;
+    }
+
+    /// The term with the given (normalized) key, or nullptr.
+    compiled_term const* find (std::string_view key) const {
+        if (!is_open() || m_header.term_count == 0)
+            return nullptr;
+
+        auto h = perfect_hash::hash(key, m_header.seed);
+        auto d = m_displacements[perfect_hash::bucket(h, m_header.bucket_count)];
+        auto& t = m_terms[perfect_hash::slot(h, d, m_header.term_count)];
+
+        // a key that is not in the dictionary lands on some other term
+        if (string(t.key) != key)
+            return nullptr;
+        return &t;
+    }
+
+    compiled_term const& term (std::size_t i) const {
+        return m_terms[i];
+    }
+
+    std::size_t entry_count (compiled_term const& t) const {
+        return std::uint64_t(t.first_ref) + t.ref_count <= m_header.ref_count
+                ? t.ref_count : 0;
+    }
+
+    /// The i-th entry of a term, i < entry_count(t).
+    compiled_entry const& entry (compiled_term const& t, std::size_t i) const {
+        static const compiled_entry none{{}, 0, 0};
+        auto e = m_refs[t.first_ref + i];
+        return e < m_header.entry_count ? m_entries[e] : none;
+    }
+
+    std::size_t sense_count (compiled_entry const& e) const {
+        return std::uint64_t(e.first_sense) + e.sense_count <= m_header.sense_count
+                ? e.sense_count : 0;
+    }
+
+    /// The i-th sense of an entry, i < sense_count(e).
+    compiled_sense const& sense (compiled_entry const& e, std::size_t i) const {
+        return m_senses[e.first_sense + i];
+    }
+
+    /// A string of the pool; empty if the span is.
+    std::string_view string (compiled_span s) const {
+        if (s.empty() || std::uint64_t(s.offset) + s.size > m_header.pool_size)
+            return {};
+        return {m_pool + s.offset, s.size};
+    }
+
+private:
+    void close () {
+        if (m_map)
+            ::munmap(const_cast<char*>(m_map), m_map_size);
+        m_map = nullptr;
+        m_map_size = 0;
+        if (m_fd >= 0)
+            ::close(m_fd);
+        m_fd = -1;
+        m_header = {};
+    }
+};
+
+/// Builds a compiled dictionary: entries are added once and then referred
+/// to by as many terms as needed; the perfect hash is built on write.
+class compiled_dict_writer {
+public:
+    struct sense_data {
+        std::uint32_t type;
+        std::optional<std::string> sn;
+        std::string text;
+    };
+
+    struct entry_data {
+        std::string headword;
+        std::string fl;
+        std::vector<sense_data> senses;
+    };
+
+private:
+    std::vector<std::pair<std::string, std::vector<std::uint32_t>>> m_terms;
+    std::vector<compiled_entry> m_entries;
+    std::vector<compiled_sense> m_senses;
+    std::string m_pool;
+    // set once anything did not fit the 32 bit offsets and counts, that
+    // would have wrapped: write then refuses the dictionary
+    bool m_too_large = false;
+
+public:
+    std::size_t size () const {
+        return m_terms.size();
+    }
+
+    std::size_t entry_count () const {
+        return m_entries.size();
+    }
+
+    std::size_t sense_count () const {
+        return m_senses.size();
+    }
+
+    /// Add an entry, returning its index for add_term.
+    std::uint32_t add_entry (entry_data const& e) {
+        if (m_entries.size() + 1 >= compiled_span::npos
+                || e.senses.size() >= compiled_span::npos - m_senses.size())
+            m_too_large = true;
+
+        compiled_entry entry;
+        entry.headword = add_string(e.headword);
+        entry.fl = add_string(e.fl);
+        entry.first_sense = m_senses.size();
+        entry.sense_count = e.senses.size();
+        for (auto& s : e.senses) {
+            compiled_sense sense;
+            sense.type = s.type;
+            if (s.sn)
+                sense.sn = add_string(*s.sn);
+            sense.text = add_string(s.text);
+            m_senses.push_back(sense);
+        }
+        m_entries.push_back(entry);
+        return m_entries.size() - 1;
+    }
+
+    /// Add a term, with its (normalized) key; keys must be unique.
+    void add_term (std::string key, std::vector<std::uint32_t> entries) {
+        m_terms.emplace_back(std::move(key), std::move(entries));
+    }
+
+    /// Write the dictionary to a temporary file, then rename it to path,
+    /// so that a reader never maps half of it.
+    bool write (std::string const& path) {
+        if (m_too_large) {
+            BOOST_LOG_TRIVIAL(error) << "Compiled dictionary too large";
+            return false;
+        }
+
+        compiled_header header{};
+        std::memcpy(header.magic, detail::compiled_magic, sizeof header.magic);
+
+        std::vector<std::uint32_t> displacements;
+        if (!build_hash(header, displacements))
+            return false;
+
+        // terms in the order of their slot, with their keys at the end
+        // of the pool
+        std::vector<compiled_term> terms(m_terms.size());
+        std::vector<std::uint32_t> refs;
+        std::string pool = m_pool;
+        for (auto& [key, entries] : m_terms) {
+            auto h = perfect_hash::hash(key, header.seed);
+            auto d = displacements[perfect_hash::bucket(h, header.bucket_count)];
+            auto& t = terms[perfect_hash::slot(h, d, m_terms.size())];
+            t.key = {static_cast<std::uint32_t>(pool.size()),
+                     static_cast<std::uint32_t>(key.size())};
+            pool += key;
+            t.first_ref = refs.size();
+            t.ref_count = entries.size();
+            refs.insert(refs.end(), entries.begin(), entries.end());
+        }
+
+        if (pool.size() >= compiled_span::npos || refs.size() >= compiled_span::npos) {
+            BOOST_LOG_TRIVIAL(error) << "Compiled dictionary too large";
+            return false;
+        }
+
+        header.pool_size = pool.size();
+        header.term_count = terms.size();
+        header.ref_count = refs.size();
+        header.entry_count = m_entries.size();
+        header.sense_count = m_senses.size();
+        detail::compiled_layout layout(header);
+
+        auto tmp = path + ".tmp";
+        std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+        auto put = [&out](std::uint64_t offset, const void* data, std::size_t size) {
+            static const char zeros[8] = {};
+            out.write(zeros, offset - static_cast<std::uint64_t>(out.tellp()));
+            out.write(static_cast<const char*>(data), size);
+        };
+        put(0, &header, sizeof header);
+        put(layout.displacements, displacements.data(),
+            displacements.size() * sizeof(std::uint32_t));
+        put(layout.terms, terms.data(), terms.size() * sizeof(compiled_term));
+        put(layout.refs, refs.data(), refs.size() * sizeof(std::uint32_t));
+        put(layout.entries, m_entries.data(), m_entries.size() * sizeof(compiled_entry));
+        put(layout.senses, m_senses.data(), m_senses.size() * sizeof(compiled_sense));
+        put(layout.pool, pool.data(), pool.size());
+        out.close();
+
+        if (!out || std::rename(tmp.c_str(), path.c_str()) != 0) {
+            BOOST_LOG_TRIVIAL(error)
+                    << "Unable to write compiled dictionary " << path
+                    << ": " << std::strerror(errno);
+            std::remove(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+private:
+    compiled_span add_string (std::string_view s) {
+        if (m_too_large || s.size() >= compiled_span::npos - m_pool.size()) {
+            m_too_large = true;
+            return {};
+        }
+
+        compiled_span span{static_cast<std::uint32_t>(m_pool.size()),
+                           static_cast<std::uint32_t>(s.size())};
+        m_pool.append(s.data(), s.size());
+        return span;
+    }
+
+    bool build_hash (compiled_header& header,
+                     std::vector<std::uint32_t>& displacements) const {
+        std::vector<std::uint64_t> hashes(m_terms.size());
+        for (std::uint64_t seed = 0; seed < 16; ++seed) {
+            for (std::size_t i = 0; i < m_terms.size(); ++i)
+                hashes[i] = perfect_hash::hash(m_terms[i].first, seed);
+            if (perfect_hash::build(hashes, displacements)) {
+                header.seed = seed;
+                header.bucket_count = displacements.size();
+                return true;
+            }
+        }
+        BOOST_LOG_TRIVIAL(error)
+                << "Unable to build the perfect hash (duplicated keys?)";
+        return false;
+    }
+};
+
+} // namespace dict
+
+#endif // COMPILED_DICT_HPP
@@ -0,0 +1,204 @@
+/**
+ * @file connection_pool.hpp
+ * @brief Bounded pool of keep-alive TLS connections with session resumption
+ * @author Giuseppe Roberti <inbox> <at> <roberti> <dot> <dev>
+ */
+#ifndef CONNECTION_POOL_HPP
+#define CONNECTION_POOL_HPP
+
+#include "arena.hpp"
+
+#include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+#include <boost/beast.hpp>
+
+#include <openssl/ssl.h>
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+
+namespace dict {
+
+namespace beast = boost::beast;
+namespace system = boost::system;
+namespace asio = boost::asio;
+
+namespace ssl = asio::ssl;
+namespace ip = asio::ip;
+
+using tcp = ip::tcp;
+
+class connection {
+public:
+    using clock = std::chrono::steady_clock;
+
+    ssl::stream<tcp::socket> stream;
+    beast::flat_buffer buffer;
+    // reused by every response read on this connection
+    parse_context parse;
+    clock::time_point last_used;
+    std::size_t requests = 0;
+
+    connection (asio::io_context& io_context, ssl::context& ssl_context):
+        stream(io_context, ssl_context)
+      , last_used(clock::now())
+    {}
+
+    void close () {
+        system::error_code ec;
+        stream.lowest_layer().close(ec);
+    }
+};
+
+struct pool_stats {
+    std::uint64_t hits = 0;
+    std::uint64_t misses = 0;
+    std::uint64_t reconnects = 0;
+    std::uint64_t evictions = 0;
+    std::uint64_t resumed = 0;
+
+    double hit_rate () const {
+        auto total = hits + misses;
+        return total ? double(hits) / double(total) : 0.0;
+    }
+
+    double miss_rate () const {
+        auto total = hits + misses;
+        return total ? double(misses) / double(total) : 0.0;
+    }
+};
+
+class connection_pool {
+private:
+    using clock = connection::clock;
+
+    std::mutex m_mutex;
+    std::deque<std::unique_ptr<connection>> m_idle;
+    SSL_SESSION* m_session = nullptr;
+
+    const std::size_t m_max_idle;
+    const clock::duration m_idle_timeout;
+
+    std::atomic<std::uint64_t> m_hits{0}, m_misses{0}, m_reconnects{0},
+            m_evictions{0}, m_resumed{0};
+
+public:
+    connection_pool (std::size_t max_idle, clock::duration idle_timeout):
+        m_max_idle(max_idle)
+      , m_idle_timeout(idle_timeout)
+    {}
+
+    connection_pool (connection_pool const&) = delete;
+    connection_pool& operator= (connection_pool const&) = delete;
+
+    ~connection_pool () {
+        for (auto& conn : m_idle)
+            conn->close();
+        if (m_session)
+            SSL_SESSION_free(m_session);
+    }
+
+    /// Take the most recently used idle connection, or nullptr on a miss.
+    std::unique_ptr<connection> acquire () {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        evict_idle(clock::now());
+
+        if (m_idle.empty()) {
+            ++m_misses;
+            return nullptr;
+        }
+
+        ++m_hits;
+        auto conn = std::move(m_idle.back());
+        m_idle.pop_back();
+        return conn;
+    }
+
+    /// Give back a connection that is still usable for another request.
+    void release (std::unique_ptr<connection> conn) {
+        auto now = clock::now();
+        conn->last_used = now;
+
+        save_session(*conn);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        evict_idle(now);
+
+        if (m_idle.size() >= m_max_idle) {
+            ++m_evictions;
+            m_idle.front()->close();
+            m_idle.pop_front();
+        }
+
+        m_idle.push_back(std::move(conn));
+    }
+
+    /// Offer the last known session ticket to a fresh connection.
+    void resume_session (connection& conn) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_session)
+            SSL_set_session(conn.stream.native_handle(), m_session);
+    }
+
+    void handshake_done (connection& conn) {
+        if (SSL_session_reused(conn.stream.native_handle()))
+            ++m_resumed;
+
+        save_session(conn);
+    }
+
+    void reconnected () {
+        ++m_reconnects;
+    }
+
+    void evict_idle () {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        evict_idle(clock::now());
+    }
+
+    pool_stats stats () const {
+        pool_stats s;
+        s.hits = m_hits;
+        s.misses = m_misses;
+        s.reconnects = m_reconnects;
+        s.evictions = m_evictions;
+        s.resumed = m_resumed;
+        return s;
+    }
+
+private:
+    void evict_idle (clock::time_point now) {
+        while (!m_idle.empty() && now - m_idle.front()->last_used > m_idle_timeout) {
+            ++m_evictions;
+            m_idle.front()->close();
+            m_idle.pop_front();
+        }
+    }
+
+    void save_session (connection& conn) {
+        // with TLS 1.3 the ticket arrives after the handshake, so we try
+        // again every time a connection comes back to the pool
+        SSL_SESSION* session = SSL_get1_session(conn.stream.native_handle());
+        if (!session)
+            return;
+
+        if (!SSL_SESSION_is_resumable(session)) {
+            SSL_SESSION_free(session);
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_session)
+            SSL_SESSION_free(m_session);
+        m_session = session;
+    }
+};
+
+} // namespace dict
+
+#endif // CONNECTION_POOL_HPP
@@ -0,0 +1,250 @@
+/**
+ * @file content_decoder.hpp
+ * @brief Streaming decoder of compressed HTTP bodies (gzip, deflate, br)
+ * @author Giuseppe Roberti <inbox> <at> <roberti> <dot> <dev>
+ */
+#ifndef CONTENT_DECODER_HPP
+#define CONTENT_DECODER_HPP
+
+#include <boost/system/error_code.hpp>
+
+#ifdef DICT_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef DICT_HAVE_BROTLI
+#include <brotli/decode.h>
+#endif
+
+#include <cctype>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <optional>
+#include <string_view>
+
+namespace dict {
+
+/// Decodes a body a buffer at a time, as it is received: nothing is kept
+/// but the state of the decompressor and a small output buffer.
+class content_decoder {
+public:
+    enum class coding { gzip, deflate, br };
+
+private:
+    static constexpr std::size_t chunk_size = 16 * 1024;
+
+    coding m_coding;
+    bool m_done = false;
+    bool m_started = false;
+    char m_head[2];
+    std::size_t m_head_size = 0;
+    std::unique_ptr<char[]> m_out;
+#ifdef DICT_HAVE_ZLIB
+    z_stream m_zlib{};
+#endif
+#ifdef DICT_HAVE_BROTLI
+    BrotliDecoderState* m_brotli = nullptr;
+#endif
+
+public:
+    /// The value of Accept-Encoding for what can be decoded, empty if nothing.
+    static constexpr const char* accepted () {
+#if defined(DICT_HAVE_BROTLI) && defined(DICT_HAVE_ZLIB)
+        return "br, gzip, deflate";
+#elif defined(DICT_HAVE_ZLIB)
+        return "gzip, deflate";
+#elif defined(DICT_HAVE_BROTLI)
+        return "br";
+#else
+        return "";
+#endif
+    }
+
+    /// The coding named by a Content-Encoding value; nullopt for identity
+    /// (or no value) and for the ones that cannot be decoded, with ec set.
+    static std::optional<coding> parse (std::string_view value,
+                                        boost::system::error_code& ec) {
+        ec = {};
+        while (!value.empty() && std::isspace(static_cast<unsigned char>(value.front())))
+            value.remove_prefix(1);
+        while (!value.empty() && std::isspace(static_cast<unsigned char>(value.back())))
+            value.remove_suffix(1);
+
+        auto is = [value](std::string_view name) {
+            if (value.size() != name.size())
+                return false;
+            for (std::size_t i = 0; i < name.size(); ++i)
+                if (std::tolower(static_cast<unsigned char>(value[i])) != name[i])
+                    return false;
+            return true;
+        };
+
+        if (value.empty() || is("identity"))
+            return std::nullopt;
+#ifdef DICT_HAVE_ZLIB
+        if (is("gzip") || is("x-gzip"))
+            return coding::gzip;
+        if (is("deflate"))
+            return coding::deflate;
+#endif
+#ifdef DICT_HAVE_BROTLI
+        if (is("br"))
+            return coding::br;
+#endif
+        ec = make_error_code(boost::system::errc::not_supported);
+        return std::nullopt;
+    }
+
+    explicit content_decoder (coding c):
+        m_coding(c)
+      , m_out(new char[chunk_size])
+    {
+#ifdef DICT_HAVE_ZLIB
+        // gzip or zlib headers are detected automatically
+        if (c != coding::br && inflateInit2(&m_zlib, 15 + 32) != Z_OK)
+            throw std::bad_alloc();
+#endif
+#ifdef DICT_HAVE_BROTLI
+        if (c == coding::br && !(m_brotli = BrotliDecoderCreateInstance(nullptr, nullptr, nullptr)))
+            throw std::bad_alloc();
+#endif
+    }
+
+    content_decoder (content_decoder const&) = delete;
+    content_decoder& operator= (content_decoder const&) = delete;
+
+    ~content_decoder () {
+#ifdef DICT_HAVE_ZLIB
+        if (m_coding != coding::br)
+            inflateEnd(&m_zlib);
+#endif
+#ifdef DICT_HAVE_BROTLI
+        if (m_brotli)
+            BrotliDecoderDestroyInstance(m_brotli);
+#endif
+    }
+
+    /// Whether the end of the compressed stream was reached.
+    bool done () const {
+        return m_done;
+    }
+
+    /// Decode size bytes, passing the output to sink (const char*, size_t)
+    /// a chunk at a time; sink returns false to stop.
+    template<class Sink>
+    void write (const char* data, std::size_t size, Sink&& sink,
+                boost::system::error_code& ec) {
+        ec = {};
+        if (m_done) {
+            if (size)
+                ec = make_error_code(boost::system::errc::illegal_byte_sequence);
+            return;
+        }
+        if (m_coding == coding::br)
+            write_brotli(data, size, sink, ec);
+        else
+            write_zlib(data, size, sink, ec);
+    }
+
+private:
+    template<class Sink>
+    void write_zlib (const char* data, std::size_t size, Sink& sink,
+                     boost::system::error_code& ec) {
+#ifdef DICT_HAVE_ZLIB
+        if (m_coding == coding::deflate && !m_started) {
+            // zlib wrapped, as the standard says, or raw, as some servers
+            // send it: the first two bytes tell them apart
+            for (; size && m_head_size < 2; --size)
+                m_head[m_head_size++] = *data++;
+            if (m_head_size < 2)
+                return;
+            m_started = true;
+
+            unsigned b0 = static_cast<unsigned char>(m_head[0]);
+            unsigned b1 = static_cast<unsigned char>(m_head[1]);
+            if ((b0 & 0x0f) != 8 || (b0 * 256 + b1) % 31 != 0) {
+                inflateEnd(&m_zlib);
+                m_zlib = {};
+                if (inflateInit2(&m_zlib, -15) != Z_OK)
+                    throw std::bad_alloc();
+            }
+            if (!inflate_some(m_head, 2, sink, ec))
+                return;
+        }
+
+        inflate_some(data, size, sink, ec);
+#else
+        ec = make_error_code(boost::system::errc::not_supported);
+#endif
+    }
+
+#ifdef DICT_HAVE_ZLIB
+    template<class Sink>
+    bool inflate_some (const char* data, std::size_t size, Sink& sink,
+                       boost::system::error_code& ec) {
+        m_zlib.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+        m_zlib.avail_in = static_cast<uInt>(size);
+
+        while (!m_done && (m_zlib.avail_in > 0 || m_zlib.avail_out == 0)) {
+            m_zlib.next_out = reinterpret_cast<Bytef*>(m_out.get());
+            m_zlib.avail_out = chunk_size;
+
+            int rc = inflate(&m_zlib, Z_NO_FLUSH);
+            if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
+                ec = make_error_code(boost::system::errc::illegal_byte_sequence);
+                return false;
+            }
+
+            m_done = rc == Z_STREAM_END;
+            auto n = chunk_size - m_zlib.avail_out;
+            if (n && !sink(m_out.get(), n))
+                return false;
+            if (rc == Z_BUF_ERROR)
+                break;
+        }
+
+        if (m_done && m_zlib.avail_in > 0) {
+            ec = make_error_code(boost::system::errc::illegal_byte_sequence);
+            return false;
+        }
+        return true;
+    }
+#endif
+
+    template<class Sink>
+    void write_brotli (const char* data, std::size_t size, Sink& sink,
+                       boost::system::error_code& ec) {
+#ifdef DICT_HAVE_BROTLI
+        auto next_in = reinterpret_cast<const std::uint8_t*>(data);
+        std::size_t avail_in = size;
+
+        for (;;) {
+            auto next_out = reinterpret_cast<std::uint8_t*>(m_out.get());
+            std::size_t avail_out = chunk_size;
+
+            auto rc = BrotliDecoderDecompressStream(m_brotli, &avail_in, &next_in,
+                                                    &avail_out, &next_out, nullptr);
+            if (rc == BROTLI_DECODER_RESULT_ERROR) {
+                ec = make_error_code(boost::system::errc::illegal_byte_sequence);
+                return;
+            }
+
+            m_done = rc == BROTLI_DECODER_RESULT_SUCCESS;
+            auto n = chunk_size - avail_out;
+            if (n && !sink(m_out.get(), n))
+                return;
+            if (rc != BROTLI_DECODER_RESULT_NEEDS_MORE_OUTPUT)
+                break;
+        }
+
+        if (m_done && avail_in > 0)
+            ec = make_error_code(boost::system::errc::illegal_byte_sequence);
+#else
+        ec = make_error_code(boost::system::errc::not_supported);
+#endif
+    }
+};
+
+} // namespace dict
+
+#endif // CONTENT_DECODER_HPP
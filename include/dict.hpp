@@ -6,7 +6,16 @@
 #ifndef DICT_HPP
 #define DICT_HPP
 
+#include "compiled_dict.hpp"
+#include "connection_pool.hpp"
+#include "fuzzy_index.hpp"
 #include "json_body.hpp"
+#include "lru_cache.hpp"
+#include "metrics.hpp"
+#include "resolver_cache.hpp"
+#include "response_cache.hpp"
+#include "text_index.hpp"
+#include "trace.hpp"
 
 #include <boost/asio.hpp>
 #include <boost/asio/ssl.hpp>
@@ -17,7 +26,22 @@
 #include <unordered_map>
 #include <algorithm>
 #include <thread>
+#include <vector>
 #include <optional>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdlib>
+#include <exception>
+#include <filesystem>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
 
 namespace dict {
 
@@ -40,103 +64,142 @@ public:
         sls
     };
 
+    static const char* type_name (type sense_type) {
+        switch (sense_type) {
+        case type::noun:
+            return "noun";
+        case type::verb:
+            return "verb";
+        case type::sls:
+            return "sls";
+        }
+        return "";
+    }
+
 private:
-    json::object const& m_sense;
-    type const m_type;
-    std::optional<std::reference_wrapper<const json::string>> m_sn;
-    json::string const& m_text;
+    type m_type;
+    std::optional<std::string_view> m_sn;
+    std::string_view m_text;
 
 public:
     sense (json::value const& sense, type const sense_type):
-        m_sense(sense.as_object()),
         m_type(sense_type),
-        m_sn(find_sn()),
-        m_text(find_text())
+        m_sn(find_sn(sense.as_object())),
+        m_text(find_text(sense.as_object()))
+    {}
+
+    /// A sense whose text is owned by something else (eg: a compiled_dict).
+    sense (type const sense_type, std::optional<std::string_view> sn,
+           std::string_view text):
+        m_type(sense_type),
+        m_sn(sn),
+        m_text(text)
     {}
 
     const char* get_type () const {
-        switch (m_type) {
-        case type::noun:
-            return "noun";
-        case type::verb:
-            return "verb";
-        case type::sls:
-            return "sls";
-        }
+        return type_name(m_type);
+    }
+
+    type get_type_id () const {
+        return m_type;
     }
 
-    std::optional<std::reference_wrapper<const json::string>> get_sn () const {
+    std::optional<std::string_view> get_sn () const {
         return m_sn;
     }
 
-    json::string const& get_text () const {
+    std::string_view get_text () const {
         return m_text;
     }
 
 private:
-    std::optional<std::reference_wrapper<const json::string>> find_sn () {
-        if (m_sense.contains("sn"))
-            return m_sense.at("sn").as_string();
-        else
+    static std::optional<std::string_view> find_sn (json::object const& sense) {
+        if (sense.contains("sn")) {
+            auto& sn = sense.at("sn").as_string();
+            return std::string_view(sn.data(), sn.size());
+        } else {
             return std::nullopt;
+        }
     }
 
-    json::string const& find_text () {
-        auto& dt_a = m_sense.at("dt").as_array();
+    static std::string_view find_text (json::object const& sense) {
+        auto& dt_a = sense.at("dt").as_array();
         auto val = std::find_if(dt_a.begin(), dt_a.end(), [](json::value const& v) {
                 return v.as_array().at(0).as_string().compare("text") == 0;
         });
-        return val->as_array().at(1).as_string();
+        if (val == dt_a.end())
+            throw std::out_of_range("sense without text");
+        auto& text = val->as_array().at(1).as_string();
+        return {text.data(), text.size()};
     }
 };
 
 class entry {
 private:
-    json::object const& m_entry;
+    // as received, with the marks between its syllables
+    std::string_view m_headword;
+    std::string_view m_fl;
     std::vector<sense> m_senses;
 
 public:
-    entry (json::value const& entry):
-        m_entry(entry.as_object())
+    entry (json::value const& entry)
     {
-        json::array const& defs = m_entry.at("def").as_array();
+        DICT_TRACE_SCOPE("entry");
+
+        auto& object = entry.as_object();
+        json::array const& defs = object.at("def").as_array();
 
         for (auto& def : defs)
             parse_def (def.as_object());
 
-        BOOST_LOG_TRIVIAL(trace)
-                << "Costructed an entry with "
-                << defs.size() << " definitions and "
-                << m_senses.size() << " senses";
+        auto* hwi = object.if_contains("hwi");
+        auto* hw = hwi && hwi->is_object() ? hwi->get_object().if_contains("hw") : nullptr;
+        if (hw && hw->is_string())
+            m_headword = {hw->get_string().data(), hw->get_string().size()};
+
+        auto* fl = object.if_contains("fl");
+        if (fl && fl->is_string())
+            m_fl = {fl->get_string().data(), fl->get_string().size()};
+
+        DICT_TRACE_INSTANT("entry.senses", "senses", m_senses.size());
     }
 
+    /// An entry whose text is owned by something else (eg: a compiled_dict).
+    entry (std::string_view headword, std::string_view fl, std::vector<sense> senses):
+        m_headword(headword),
+        m_fl(fl),
+        m_senses(std::move(senses))
+    {}
+
     auto& senses () const {
         return m_senses;
     }
 
+    /// The headword, without the marks between its syllables.
+    std::string get_headword () const {
+        std::string headword;
+        for (char c : m_headword)
+            if (c != '*')
+                headword.push_back(c);
+        return headword;
+    }
+
+    /// The functional label (eg: noun), or empty.
+    std::string_view get_fl () const {
+        return m_fl;
+    }
+
 private:
     void parse_def (json::object const& def) {
         sense::type sense_type;
 
-        if (auto* vd = def.if_contains("vd")) {
+        if (def.contains("vd"))
             sense_type = sense::type::verb;
-
-            BOOST_LOG_TRIVIAL(trace)
-                    << "Found verb divider "
-                    << vd->as_string();
-        } else if (auto* sls = def.if_contains("sls")) {
+        else if (def.contains("sls"))
             sense_type = sense::type::sls;
-
-            BOOST_LOG_TRIVIAL(trace)
-                    << "Found sls:\n"
-                    << *sls;
-        } else {
+        else
             sense_type = sense::type::noun;
 
-            BOOST_LOG_TRIVIAL(trace)
-                    << "It should be a noun";
-        }
-
         auto& sseq = def.at("sseq");
 
         for (auto& senses : sseq.as_array())
@@ -157,33 +220,226 @@ private:
     }
 };
 
+/// Bytes allocated for a json::value tree, not counting the value itself.
+inline std::size_t json_footprint (json::value const& value) {
+    std::size_t bytes = 0;
+
+    switch (value.kind()) {
+    case json::kind::string:
+        bytes += value.get_string().capacity() + 1;
+        break;
+    case json::kind::array: {
+        auto& array = value.get_array();
+        bytes += array.capacity() * sizeof(json::value);
+        for (auto& v : array)
+            bytes += json_footprint(v);
+        break;
+    }
+    case json::kind::object: {
+        auto& object = value.get_object();
+        // slots plus their hash buckets
+        bytes += object.capacity()
+                * (sizeof(json::key_value_pair) + sizeof(std::uint32_t));
+        for (auto& kv : object)
+            bytes += kv.key().size() + 1 + json_footprint(kv.value());
+        break;
+    }
+    default:
+        break;
+    }
+
+    return bytes;
+}
+
 class result {
 private:
     const json::value m_result;
+    // what the views of the entries point into, when not m_result
+    std::shared_ptr<const void> m_owner;
+    std::vector<std::shared_ptr<const result>> m_parts;
     std::vector<entry> m_entries;
+    // without the arenas the JSON is in, that may be shared by many
+    std::size_t m_footprint;
+    std::vector<arena const*> m_arenas;
 
 public:
-    result (json::value const&& result):
+    result (json::value&& result):
         m_result(std::move(result))
     {
+        DICT_TRACE_SCOPE("result");
+
         for (auto& e : m_result.as_array()) {
             try {
                 m_entries.emplace_back(e);
             } catch (std::exception& e) {
-                BOOST_LOG_TRIVIAL(trace)
-                        << "Unable to parse an entry";
+                DICT_TRACE_INSTANT("result.bad_entry", nullptr, 0);
             }
         }
 
-        BOOST_LOG_TRIVIAL(trace)
-                << "Costructed a result with "
-                << m_result.as_array().size()
-                << " entries";
+        // the whole arena is kept alive by the JSON, whatever it takes
+        m_footprint = sizeof(*this) + m_entries.capacity() * sizeof(entry);
+        if (auto* a = dynamic_cast<arena const*>(m_result.storage().get()))
+            m_arenas.push_back(a);
+        else
+            m_footprint += json_footprint(m_result);
+        for (auto& e : m_entries)
+            m_footprint += e.senses().capacity() * sizeof(sense);
+    }
+
+    /// A result of entries that view the memory of owner, kept alive: it is
+    /// not charged for it.
+    result (std::shared_ptr<const void> owner, std::vector<entry> entries):
+        m_owner(std::move(owner))
+      , m_entries(std::move(entries))
+    {
+        m_footprint = sizeof(*this) + m_entries.capacity() * sizeof(entry);
+        for (auto& e : m_entries)
+            m_footprint += e.senses().capacity() * sizeof(sense);
+    }
+
+    /// A result made of the entries of other results, that are kept alive.
+    result (std::vector<std::shared_ptr<const result>> parts):
+        m_parts(std::move(parts))
+    {
+        DICT_TRACE_SCOPE("result.join");
+
+        std::size_t count = 0;
+        for (auto& part : m_parts)
+            count += part->entries().size();
+        m_entries.reserve(count);
+
+        m_footprint = sizeof(*this)
+                + m_parts.capacity() * sizeof(m_parts.front())
+                + m_entries.capacity() * sizeof(entry);
+        for (auto& part : m_parts) {
+            for (auto& e : part->entries())
+                m_entries.push_back(e);
+            m_footprint += part->m_footprint;
+            for (auto* a : part->m_arenas)
+                if (std::find(m_arenas.begin(), m_arenas.end(), a) == m_arenas.end())
+                    m_arenas.push_back(a);
+        }
     }
 
-    auto& entries () const {
+    std::vector<entry> const& entries () const {
         return m_entries;
     }
+
+    /// Approximate bytes of memory owned by this result, counting every
+    /// arena it keeps alive once.
+    std::size_t memory_footprint () const {
+        auto bytes = m_footprint;
+        for (auto* a : m_arenas)
+            bytes += a->reserved();
+        return bytes;
+    }
+};
+
+using result_cache = lru_cache<result>;
+
+/// The entries of a term of a compiled dictionary, read in place from the
+/// mapped file, that is kept alive as long as the result.
+class compiled_result {
+public:
+    class sense_ref {
+    private:
+        compiled_dict const& m_dict;
+        compiled_sense const& m_sense;
+
+    public:
+        sense_ref (compiled_dict const& dict, compiled_sense const& sense):
+            m_dict(dict), m_sense(sense)
+        {}
+
+        const char* get_type () const {
+            return sense::type_name(get_type_id());
+        }
+
+        sense::type get_type_id () const {
+            return static_cast<sense::type>(m_sense.type);
+        }
+
+        std::optional<std::string_view> get_sn () const {
+            if (m_sense.sn.empty())
+                return std::nullopt;
+            return m_dict.string(m_sense.sn);
+        }
+
+        std::string_view get_text () const {
+            return m_dict.string(m_sense.text);
+        }
+    };
+
+    class entry_ref {
+    private:
+        compiled_dict const& m_dict;
+        compiled_entry const& m_entry;
+
+    public:
+        entry_ref (compiled_dict const& dict, compiled_entry const& entry):
+            m_dict(dict), m_entry(entry)
+        {}
+
+        std::string_view get_headword () const {
+            return m_dict.string(m_entry.headword);
+        }
+
+        std::string_view get_fl () const {
+            return m_dict.string(m_entry.fl);
+        }
+
+        std::size_t size () const {
+            return m_dict.sense_count(m_entry);
+        }
+
+        sense_ref operator[] (std::size_t i) const {
+            return {m_dict, m_dict.sense(m_entry, i)};
+        }
+    };
+
+private:
+    std::shared_ptr<const compiled_dict> m_dict;
+    compiled_term const* m_term;
+
+public:
+    compiled_result (std::shared_ptr<const compiled_dict> dict,
+                     compiled_term const& term):
+        m_dict(std::move(dict)), m_term(&term)
+    {}
+
+    std::size_t size () const {
+        return m_dict->entry_count(*m_term);
+    }
+
+    entry_ref operator[] (std::size_t i) const {
+        return {*m_dict, m_dict->entry(*m_term, i)};
+    }
+
+    /// What keeps the mapped file, and so every view of it, alive.
+    std::shared_ptr<const void> owner () const {
+        return m_dict;
+    }
+
+    /// A result of the entries, that views the mapped file in place: only
+    /// the vectors of entries and senses are allocated.
+    std::shared_ptr<const result> to_result () const {
+        std::vector<entry> entries;
+        entries.reserve(size());
+
+        for (std::size_t i = 0; i < size(); ++i) {
+            auto e = (*this)[i];
+
+            std::vector<sense> senses;
+            senses.reserve(e.size());
+            for (std::size_t j = 0; j < e.size(); ++j) {
+                auto s = e[j];
+                senses.emplace_back(s.get_type_id(), s.get_sn(), s.get_text());
+            }
+            entries.emplace_back(e.get_headword(), e.get_fl(), std::move(senses));
+        }
+
+        return std::make_shared<const result>(m_dict, std::move(entries));
+    }
 };
 
 class suggestions : public std::exception, public std::vector<std::string> {
@@ -193,94 +449,1397 @@ public:
         for (auto& s : suggestions.as_array())
             emplace_back(s.as_string());
     }
+
+    suggestions (std::vector<std::string> terms):
+        std::vector<std::string>(std::move(terms))
+    {}
+};
+
+class offline_miss : public std::runtime_error {
+public:
+    offline_miss (std::string const& word):
+        std::runtime_error("The term \"" + word + "\" is not in the offline cache")
+    {}
+};
+
+/// Key used to index a term: trimmed, lower case, with single spaces.
+inline std::string normalize (std::string_view term) {
+    std::string key;
+    key.reserve(term.size());
+    bool space = false;
+    for (unsigned char c : term) {
+        if (std::isspace(c)) {
+            space = !key.empty();
+            continue;
+        }
+        if (space)
+            key.push_back(' ');
+        space = false;
+        key.push_back(std::tolower(c));
+    }
+    return key;
+}
+
+/// Percent-encode every byte but the unreserved ones of RFC 3986, so that
+/// a term is taken as a single path segment (or query value) whatever it has.
+inline std::string percent_encode (std::string_view text) {
+    static constexpr char hex[] = "0123456789ABCDEF";
+    std::string encoded;
+    encoded.reserve(text.size());
+    for (unsigned char c : text) {
+        if (std::isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~') {
+            encoded.push_back(c);
+        } else {
+            encoded.push_back('%');
+            encoded.push_back(hex[c >> 4]);
+            encoded.push_back(hex[c & 15]);
+        }
+    }
+    return encoded;
+}
+
+/// A reference of the service (eg: collegiate, thesaurus or learners),
+/// looked up at /api/v3/references/{name}/json.
+struct reference {
+    std::string name;
+    std::string key;                        ///< the key of the api when empty
+    std::chrono::milliseconds deadline{0};  ///< dropped when slower, 0 waits
+};
+
+struct api_options {
+    // the service, or a stand-in for it (see tools/mock_server.cpp)
+    std::string host = "www.dictionaryapi.com";
+    std::string port = "https";
+    std::string ca_file;
+    bool verify_peer = true;
+
+    std::size_t pool_max_idle = 4;
+    std::chrono::seconds pool_idle_timeout{30};
+    std::chrono::seconds dns_ttl{300};
+    std::chrono::seconds dns_retry{5};
+    std::string cache_path;
+    std::chrono::seconds cache_max_age{std::chrono::hours(24 * 30)};
+    std::uint64_t cache_max_size = response_cache::default_max_size;
+    bool offline = false;
+    std::optional<std::size_t> result_cache_budget;
+    std::string wordlist;
+    std::string compiled;
+    bool text_index = true;
+
+    // looked up at once for every term, their entries merged in this
+    // order; the first one is the reference of the compiled dictionary
+    std::vector<reference> references{reference{"collegiate"}};
+
+    /// References from a list like "collegiate,thesaurus:KEY@800", with
+    /// the name, then the key and the deadline in milliseconds if any, of
+    /// each reference.
+    static std::vector<reference> parse_references (std::string_view list) {
+        std::vector<reference> references;
+        while (!list.empty()) {
+            auto item = list.substr(0, list.find(','));
+            list.remove_prefix(std::min(item.size() + 1, list.size()));
+
+            reference r;
+            auto at = item.find('@');
+            if (at != std::string_view::npos) {
+                r.deadline = std::chrono::milliseconds(
+                            std::atoll(std::string(item.substr(at + 1)).c_str()));
+                item = item.substr(0, at);
+            }
+            auto colon = item.find(':');
+            if (colon != std::string_view::npos) {
+                r.key = item.substr(colon + 1);
+                item = item.substr(0, colon);
+            }
+            r.name = item;
+            if (!r.name.empty())
+                references.push_back(std::move(r));
+        }
+        return references;
+    }
+
+    /// Options taken from the DICTIONARY_* environment variables.
+    static api_options from_env () {
+        api_options options;
+
+        if (auto* host = std::getenv("DICTIONARY_HOST"))
+            options.host = host;
+
+        if (auto* port = std::getenv("DICTIONARY_PORT"))
+            options.port = port;
+
+        if (auto* ca_file = std::getenv("DICTIONARY_CA_FILE"))
+            options.ca_file = ca_file;
+
+        if (auto* insecure = std::getenv("DICTIONARY_INSECURE"))
+            options.verify_peer = !*insecure || std::string(insecure) == "0";
+
+        if (auto* path = std::getenv("DICTIONARY_CACHE")) {
+            options.cache_path = path;
+        } else if (auto* xdg = std::getenv("XDG_CACHE_HOME")) {
+            options.cache_path = std::string(xdg) + "/dictionary/responses.cache";
+        } else if (auto* home = std::getenv("HOME")) {
+            options.cache_path = std::string(home) + "/.cache/dictionary/responses.cache";
+        }
+
+        if (auto* max_age = std::getenv("DICTIONARY_CACHE_MAX_AGE"))
+            options.cache_max_age = std::chrono::seconds(std::atoll(max_age));
+
+        if (auto* max_size = std::getenv("DICTIONARY_CACHE_MAX_BYTES"))
+            options.cache_max_size = std::strtoull(max_size, nullptr, 10);
+
+        if (auto* budget = std::getenv("DICTIONARY_RESULT_CACHE_BYTES"))
+            options.result_cache_budget = std::strtoull(budget, nullptr, 10);
+
+        if (auto* wordlist = std::getenv("DICTIONARY_WORDLIST"))
+            options.wordlist = wordlist;
+
+        if (auto* compiled = std::getenv("DICTIONARY_COMPILED"))
+            options.compiled = compiled;
+
+        if (auto* text_index = std::getenv("DICTIONARY_TEXT_INDEX"))
+            options.text_index = !*text_index || std::string(text_index) != "0";
+
+        if (auto* offline = std::getenv("DICTIONARY_OFFLINE"))
+            options.offline = *offline && std::string(offline) != "0";
+
+        if (auto* references = std::getenv("DICTIONARY_REFERENCES")) {
+            auto parsed = parse_references(references);
+            if (!parsed.empty())
+                options.references = std::move(parsed);
+        }
+
+        return options;
+    }
 };
 
 class api {
+public:
+    using result_ptr = std::shared_ptr<const result>;
+    using handler_type = std::function<void(std::exception_ptr, result_ptr)>;
+    using entry_handler = std::function<void(result_ptr)>;
+    using outcome_handler = std::function<
+            void(std::string const&, std::exception_ptr, result_ptr)>;
+
 private:
     asio::io_context m_io_context;
+    asio::executor_work_guard<asio::io_context::executor_type> m_work;
     ssl::context m_ssl_context;
-    const std::string m_host, m_port, m_base_path, m_api_key;
+    const std::string m_host, m_port;
+    std::vector<reference> m_references;
+    // what the merged results depend on, see result_key
+    std::string m_scope;
+    const bool m_verify_peer;
+    connection_pool m_pool;
+    // evicts the idle connections even when no request comes
+    asio::steady_timer m_evict_timer;
+    const std::chrono::seconds m_pool_idle_timeout;
+    resolver_cache m_resolver;
+    std::unique_ptr<response_cache> m_cache;
+    std::shared_ptr<const compiled_dict> m_compiled;
+    result_cache& m_results;
+    metrics& m_metrics;
+    // the terms of the compiled dictionary are only added on the first
+    // completion or suggestion (see index_compiled_terms)
+    mutable fuzzy_index m_index;
+    mutable std::once_flag m_compiled_indexed;
+    std::atomic<bool> m_lexicon{false};
+    std::unique_ptr<text_index> m_text;
+    const std::chrono::seconds m_cache_max_age;
+    std::atomic<bool> m_offline;
+
+    // lookups in flight by normalized term, only used on the api thread
+    class flight;
+    std::unordered_map<std::string, std::shared_ptr<flight>> m_flights;
+    std::atomic<std::uint64_t> m_coalesced{0};
+
+    std::thread m_io_thread;
 
 public:
-    api (std::string api_key) :
-        m_ssl_context(ssl::context::sslv23_client)
-      , m_host("www.dictionaryapi.com"), m_port("https")
-      , m_base_path("/api/v3/references/collegiate/json")
-      , m_api_key(api_key)
+    api (std::string api_key, api_options const& options = {}) :
+        m_work(asio::make_work_guard(m_io_context))
+      , m_ssl_context(ssl::context::sslv23_client)
+      , m_host(options.host), m_port(options.port)
+      , m_references(options.references)
+      , m_verify_peer(options.verify_peer)
+      , m_pool(options.pool_max_idle, options.pool_idle_timeout)
+      , m_evict_timer(m_io_context)
+      , m_pool_idle_timeout(options.pool_idle_timeout)
+      , m_resolver(m_io_context, m_host, m_port,
+                   options.dns_ttl, options.dns_retry)
+      , m_results(result_cache::global())
+      , m_metrics(metrics::global())
+      , m_cache_max_age(options.cache_max_age)
+      , m_offline(options.offline)
     {
+        if (m_references.empty())
+            m_references.push_back(reference{"collegiate"});
+        m_scope = m_host + ":" + m_port + "/";
+        for (auto& r : m_references) {
+            if (r.key.empty())
+                r.key = api_key;
+            m_scope += r.name + (&r == &m_references.back() ? "" : ",");
+        }
+
         m_ssl_context.set_default_verify_paths();
+        if (!options.ca_file.empty())
+            m_ssl_context.load_verify_file(options.ca_file);
+
+        if (options.result_cache_budget)
+            m_results.set_budget(*options.result_cache_budget);
+
+        if (!options.cache_path.empty()) {
+            std::error_code ec;
+            std::filesystem::create_directories(
+                        std::filesystem::path(options.cache_path).parent_path(), ec);
+            m_cache = std::make_unique<response_cache>(options.cache_path,
+                                                       options.cache_max_size);
+            if (!m_cache->is_open())
+                m_cache.reset();
+        }
+
+        // only mapped: its terms are read when they are looked up
+        if (!options.compiled.empty()) {
+            auto compiled = std::make_shared<const compiled_dict>(options.compiled);
+            if (compiled->is_open())
+                m_compiled = std::move(compiled);
+        }
+
+        // every request (and background work, like refreshing resolved
+        // endpoints) runs on this single event loop
+        m_resolver.start();
+        asio::post(m_io_context, [this]{ evict_idle(); });
+        if (!options.wordlist.empty())
+            asio::post(m_io_context, [this, path = options.wordlist]{
+                m_lexicon = m_index.load_file(path) > 0;
+            });
+        if (options.text_index) {
+            m_text = std::make_unique<text_index>();
+            if (m_compiled)
+                asio::post(m_io_context, [this]{ index_compiled(0); });
+            if (m_cache)
+                asio::post(m_io_context, [this]{
+                    // the responses of the other references are only merged
+                    auto keys = std::make_shared<std::vector<std::string>>(m_cache->keys());
+                    keys->erase(std::remove_if(keys->begin(), keys->end(),
+                                               [this](auto const& key) {
+                        return is_secondary_key(key);
+                    }), keys->end());
+                    index_cached(std::move(keys), 0);
+                });
+        }
+        m_io_thread = std::thread([this]{
+            trace::set_thread_name("dict::api");
+            m_io_context.run();
+        });
+    }
+
+    api (api const&) = delete;
+    api& operator= (api const&) = delete;
+
+    ~api () {
+        // stopping the loop also stops the timers, like m_evict_timer
+        m_work.reset();
+        m_io_context.stop();
+        m_io_thread.join();
+    }
+
+    pool_stats connection_stats () const {
+        return m_pool.stats();
+    }
+
+    lru_stats result_cache_stats () const {
+        return m_results.stats();
+    }
+
+    /// Lookups that joined one of the same term already in flight.
+    std::uint64_t coalesced_lookups () const {
+        return m_coalesced;
+    }
+
+    /// Latency of every phase of the lookups, and bytes on the wire.
+    metrics const& lookup_metrics () const {
+        return m_metrics;
+    }
+
+    /// The lookup metrics, with the connection pool and result cache
+    /// counters, in the Prometheus text format.
+    void write_prometheus (std::ostream& os) const {
+        m_metrics.write_prometheus(os);
+
+        auto pool = connection_stats();
+        auto counter = [&os](const char* name, const char* help, std::uint64_t value) {
+            os << "# HELP " << name << " " << help << "\n"
+               << "# TYPE " << name << " counter\n"
+               << name << " " << value << "\n";
+        };
+        counter("dict_pool_hits_total", "Requests sent on a pooled connection.", pool.hits);
+        counter("dict_pool_misses_total", "Requests that opened a new connection.", pool.misses);
+        counter("dict_pool_reconnects_total", "Pooled connections found closed.", pool.reconnects);
+        counter("dict_tls_resumed_total", "TLS sessions resumed.", pool.resumed);
+
+        auto results = result_cache_stats();
+        counter("dict_result_cache_hits_total", "Lookups found in the result cache.", results.hits);
+        counter("dict_result_cache_misses_total", "Lookups missing the result cache.", results.misses);
+        counter("dict_coalesced_total", "Lookups that joined one already in flight.",
+                coalesced_lookups());
+    }
+
+    /// Up to max known terms that start with prefix, without any lookup:
+    /// they come from the word list and from the headwords and suggestions
+    /// received so far. Safe to call from any thread.
+    std::vector<std::string> complete (std::string_view prefix,
+                                       std::size_t max) const {
+        index_compiled_terms();
+        return m_index.complete(normalize(prefix), max);
+    }
+
+    /// Up to max known terms close to term, the closest first, without any
+    /// lookup: the same terms complete() knows, within one or two edits
+    /// (insertions, deletions, substitutions or transpositions of adjacent
+    /// characters). Safe to call from any thread.
+    std::vector<std::string> suggest (std::string_view term,
+                                      std::size_t max) const {
+        index_compiled_terms();
+        return m_index.suggest(normalize(term), max);
+    }
+
+    /// The references every term is looked up in, in the order their
+    /// entries are merged.
+    std::vector<reference> const& references () const {
+        return m_references;
+    }
+
+    /// The entries of a term in the compiled dictionary (see
+    /// api_options::compiled), read in place, without any copy nor
+    /// allocation but the result itself: the ones of the first reference
+    /// only. Safe to call from any thread.
+    std::optional<compiled_result> lookup_compiled (std::string_view term) const {
+        if (!m_compiled)
+            return std::nullopt;
+
+        stopwatch watch;
+        auto t = m_compiled->find(normalize(term));
+        if (!t)
+            return std::nullopt;
+        watch.lap(phase::lookup, m_metrics);
+        return compiled_result(m_compiled, *t);
     }
 
-    auto request (std::string word) {
-        // creating client socket
+    /// Up to k terms whose senses have every word of the query, best
+    /// first: only the terms looked up so far, the ones in the response
+    /// cache and the ones in the compiled dictionary are searched, and the
+    /// latter two are indexed in background. Safe to call from any thread.
+    std::vector<text_index::hit> search_definitions (std::string_view query,
+                                                     std::size_t k) const {
+        if (!m_text)
+            return {};
+        return m_text->search(query, k);
+    }
 
-        BOOST_LOG_TRIVIAL(trace)
-                << "Request term <" << word << ">";
+    /// In offline mode terms are only looked up in the response cache.
+    void set_offline (bool offline) {
+        m_offline = offline;
+    }
 
-        ssl::stream<tcp::socket> m_ssl_sock
-                (m_io_context, m_ssl_context);
-        m_ssl_sock.set_verify_mode(ssl::verify_peer);
-        m_ssl_sock.set_verify_callback(ssl::host_name_verification(m_host));
+    bool is_offline () const {
+        return m_offline;
+    }
 
-        // resolving host:port
+    asio::io_context::executor_type get_executor () {
+        return m_io_context.get_executor();
+    }
 
-        tcp::resolver m_resolver = tcp::resolver(m_io_context);
-        ip::basic_resolver_results<tcp> m_resolver_results =
-                m_resolver.resolve(m_host.c_str(), m_port.c_str());
+    /// Lookup a word without blocking. The completion signature is
+    /// void(std::exception_ptr, result_ptr) and handlers are invoked on the
+    /// api thread: the exception is a dict::suggestions when the term is not
+    /// found, or whatever went wrong while talking to the service.
+    template<class CompletionToken>
+    auto async_request (std::string word, CompletionToken&& token) {
+        return async_request(std::move(word), nullptr,
+                             std::forward<CompletionToken>(token));
+    }
 
-        BOOST_LOG_TRIVIAL(trace)
-                << "Host:service resolved to "
-                << m_resolver_results->host_name() << ":"
-                << m_resolver_results->service_name();
+    /// Like the above, but each entry is also passed to on_entry (on the api
+    /// thread) as soon as it has been received, wrapped in a result of its
+    /// own; the completion then gets a result made of all of them. Results
+    /// that do not come from the network are only passed to the completion.
+    ///
+    /// Both overloads support per-operation cancellation: when the signal
+    /// bound to the handler is emitted (from the api executor, see
+    /// get_executor) the connection in use is closed and the lookup completes
+    /// with a system_error of asio::error::operation_aborted.
+    template<class CompletionToken>
+    auto async_request (std::string word, entry_handler on_entry,
+                        CompletionToken&& token) {
+        return asio::async_initiate<CompletionToken,
+                void(std::exception_ptr, result_ptr)>(
+                    [this](auto handler, std::string word, entry_handler on_entry) {
+            using handler_t = decltype(handler);
 
-        // connecting
+            std::shared_ptr<cancellation> cancel;
+            auto slot = asio::get_associated_cancellation_slot(handler);
+            if (slot.is_connected()) {
+                cancel = std::make_shared<cancellation>();
+                slot.assign([cancel](asio::cancellation_type) {
+                    cancel->cancel();
+                });
+            }
 
-        tcp::endpoint m_endpoint =
-                asio::connect(m_ssl_sock.lowest_layer(), m_resolver_results);
+            auto h = std::make_shared<handler_t>(std::move(handler));
+            start(std::move(word), std::move(on_entry), std::move(cancel),
+                  [h](std::exception_ptr e, result_ptr r) {
+                auto slot = asio::get_associated_cancellation_slot(*h);
+                if (slot.is_connected())
+                    slot.clear();
+                std::move(*h)(e, std::move(r));
+            });
+        }, token, std::move(word), std::move(on_entry));
+    }
 
-        BOOST_LOG_TRIVIAL(trace)
-                << "Connected to endpoint "
-                << m_endpoint.address() << ":"
-                << m_endpoint.port();
+    /// Blocking lookup; never call it from the api thread.
+    result_ptr request (std::string word) {
+        return async_request(std::move(word), asio::use_future).get();
+    }
 
-        // ssl handshake
+    /// Lookup every term in a range, with at most `concurrency` requests in
+    /// flight. Each outcome is passed to `on_outcome` (on the api thread) as
+    /// soon as it is ready, with the same arguments of async_request; a
+    /// failing term does not stop the others. The completion signature is
+    /// void() and it is invoked once every term has an outcome.
+    template<class Range, class CompletionToken>
+    auto async_request_many (Range const& terms, std::size_t concurrency,
+                             outcome_handler on_outcome,
+                             CompletionToken&& token) {
+        std::vector<std::string> words(std::begin(terms), std::end(terms));
 
-        m_ssl_sock.handshake(asio::ssl::stream_base::client);
+        return asio::async_initiate<CompletionToken, void()>(
+                    [this](auto handler, std::vector<std::string> words,
+                           std::size_t concurrency, outcome_handler on_outcome) {
+            using handler_t = decltype(handler);
+            auto h = std::make_shared<handler_t>(std::move(handler));
+            auto b = std::make_shared<batch>(
+                        *this, std::move(words), std::move(on_outcome),
+                        [h]{ std::move(*h)(); });
+            asio::post(m_io_context, [b, concurrency]{
+                b->run(std::max<std::size_t>(concurrency, 1));
+            });
+        }, token, std::move(words), concurrency, std::move(on_outcome));
+    }
 
-        BOOST_LOG_TRIVIAL(trace) << "Handshake done!";
+    /// Blocking batch lookup; never call it from the api thread.
+    template<class Range>
+    void request_many (Range const& terms, std::size_t concurrency,
+                       outcome_handler on_outcome) {
+        async_request_many(terms, concurrency, std::move(on_outcome),
+                           asio::use_future).get();
+    }
 
-        // creating request
+private:
+    // stored terms are indexed a batch at a time, between the lookups
+    static constexpr std::size_t index_batch = 64;
 
-        std::string resource =
-                m_base_path + "/" + word + "?key=" + m_api_key;
-        http::request<json_body> req{http::verb::get, resource, 11};
-        req.set(http::field::host, m_host);
-        req.set(http::field::user_agent, "Dictionary/0.99");
+    // about as many as the service answers with
+    static constexpr std::size_t max_suggestions = 10;
 
-        // sending request
+    /// Close the connections idle for too long, then again every half of
+    /// that time, so that a pool gone quiet does not keep its sockets.
+    void evict_idle () {
+        m_pool.evict_idle();
+        m_evict_timer.expires_after(std::max<std::chrono::seconds>(
+                                        m_pool_idle_timeout / 2, std::chrono::seconds(1)));
+        m_evict_timer.async_wait([this](system::error_code ec) {
+            if (!ec)
+                evict_idle();
+        });
+    }
 
-        std::size_t sent = http::write(m_ssl_sock, req);
+    // the first reference keeps the bare term as its key in the response
+    // cache, like when it was the only one; the others prefix their name
+    std::string cache_key (std::size_t ref, std::string const& key) const {
+        return ref == 0 ? key : m_references[ref].name + ":" + key;
+    }
 
-        BOOST_LOG_TRIVIAL(trace) << "Wrote " << sent << " bytes";
+    // the result cache is shared by every api of the process, that may not
+    // look up the same service, nor the same references
+    std::string result_key (std::string const& key) const {
+        return m_scope + " " + key;
+    }
 
-        // read reply
+    bool is_secondary_key (std::string const& key) const {
+        for (std::size_t i = 1; i < m_references.size(); ++i) {
+            auto& name = m_references[i].name;
+            if (key.size() > name.size() && key[name.size()] == ':'
+                    && key.compare(0, name.size(), name) == 0)
+                return true;
+        }
+        return false;
+    }
 
-        beast::flat_buffer buffer;
-        http::response<json_body> res{};
-        std::size_t read = http::read(m_ssl_sock, buffer, res);
+    void index_text (std::string const& key, result const& r) {
+        std::vector<std::string_view> texts;
+        for (auto& e : r.entries())
+            for (auto& s : e.senses())
+                texts.emplace_back(s.get_text().data(), s.get_text().size());
+        m_text->add(key, texts);
+    }
 
-        BOOST_LOG_TRIVIAL(trace) << "Read " << read << " bytes";
+    // the first caller adds every term of the compiled dictionary to the
+    // fuzzy index, the others wait for it to be done
+    void index_compiled_terms () const {
+        if (m_compiled)
+            std::call_once(m_compiled_indexed, [this]{
+                DICT_TRACE_SCOPE("index.compiled_terms");
+                for (std::size_t i = 0; i < m_compiled->size(); ++i)
+                    m_index.insert(m_compiled->string(m_compiled->term(i).key));
+            });
+    }
 
-        json::value& json = res.body();
+    void index_compiled (std::size_t first) {
+        auto last = std::min(first + index_batch, m_compiled->size());
+        std::vector<std::string_view> texts;
+        for (auto i = first; i < last; ++i) {
+            auto& t = m_compiled->term(i);
+            compiled_result r(m_compiled, t);
+            texts.clear();
+            for (std::size_t e = 0; e < r.size(); ++e)
+                for (std::size_t s = 0; s < r[e].size(); ++s)
+                    texts.push_back(r[e][s].get_text());
+            m_text->add(std::string(m_compiled->string(t.key)), texts);
+        }
 
-        // if the result is an array of strings, throws suggestions
+        if (last < m_compiled->size())
+            asio::post(m_io_context, [this, last]{ index_compiled(last); });
+    }
 
-        if (json.as_array().at(0).is_string())
-            throw suggestions(json);
+    void index_cached (std::shared_ptr<std::vector<std::string>> keys,
+                       std::size_t first) {
+        auto last = std::min(first + index_batch, keys->size());
+        for (auto i = first; i < last; ++i) {
+            auto& key = (*keys)[i];
+            if (m_text->contains(key))
+                continue;
 
-        // return the result
+            json::value json;
+            system::error_code ec;
+            bool found = m_cache->find(key, response_cache::clock::duration::max(),
+                                       [&](std::string_view body) {
+                json = json::parse(body, ec);
+            });
+            if (found && !ec && json.is_array())
+                index_text(key, result(std::move(json)));
+        }
 
-        return std::make_unique<result>(std::move(json));
+        if (last < keys->size())
+            asio::post(m_io_context, [this, keys = std::move(keys), last]() mutable {
+                index_cached(std::move(keys), last);
+            });
+    }
+
+    /// Shared by a lookup and the cancellation slot of its handler; only
+    /// used on the api thread.
+    class cancellation {
+    private:
+        bool m_cancelled = false;
+        std::function<void()> m_on_cancel;
+
+    public:
+        bool cancelled () const {
+            return m_cancelled;
+        }
+
+        void on_cancel (std::function<void()> fn) {
+            m_on_cancel = std::move(fn);
+        }
+
+        void cancel () {
+            m_cancelled = true;
+            if (auto fn = std::move(m_on_cancel)) {
+                m_on_cancel = nullptr;
+                fn();
+            }
+        }
+    };
+
+    /// The request of a term to one of the references.
+    class session : public std::enable_shared_from_this<session> {
+    private:
+        api& m_api;
+        const std::size_t m_ref;
+        const std::string m_word, m_key;
+        entry_handler m_on_entry;
+        std::shared_ptr<cancellation> m_cancel;
+        handler_type m_handler;
+
+        http::request<http::empty_body> m_req;
+        std::optional<http::response_parser<json_body>> m_parser;
+        std::string m_raw;
+        std::vector<result_ptr> m_parts;
+        std::unique_ptr<connection> m_conn;
+        bool m_reused = false;
+        bool m_retry = true;
+
+        // the phase in progress
+        stopwatch m_phase;
+
+    public:
+        session (api& api, std::size_t ref, std::string word,
+                 entry_handler on_entry, std::shared_ptr<cancellation> cancel,
+                 handler_type handler):
+            m_api(api)
+          , m_ref(ref)
+          , m_word(std::move(word))
+          , m_key(api.cache_key(ref, normalize(m_word)))
+          , m_on_entry(std::move(on_entry))
+          , m_cancel(std::move(cancel))
+          , m_handler(std::move(handler))
+        {
+            // creating request
+
+            auto& reference = m_api.m_references[m_ref];
+            std::string resource = "/api/v3/references/" + percent_encode(reference.name)
+                    + "/json/" + percent_encode(m_word)
+                    + "?key=" + percent_encode(reference.key);
+            m_req = {http::verb::get, resource, 11};
+            m_req.set(http::field::host, m_api.m_host);
+            m_req.set(http::field::user_agent, "Dictionary/0.99");
+            if (*content_decoder::accepted())
+                m_req.set(http::field::accept_encoding, content_decoder::accepted());
+            m_req.keep_alive(true);
+        }
+
+        void run () {
+            DICT_TRACE_INSTANT("lookup.run", "retry", !m_retry);
+
+            if (cancelled())
+                return fail(asio::error::operation_aborted);
+
+            // looking up the compiled dictionary, then the response cache
+
+            if (m_retry && (lookup_compiled() || lookup_cache()))
+                return;
+
+            if (m_api.m_offline)
+                return complete(std::make_exception_ptr(offline_miss(m_word)),
+                                nullptr);
+
+            if (m_cancel)
+                m_cancel->on_cancel([weak = weak_from_this()]{
+                    if (auto self = weak.lock())
+                        self->cancel();
+                });
+
+            // reusing a pooled connection or creating a new one
+
+            m_conn = m_api.m_pool.acquire();
+            m_reused = m_conn != nullptr;
+
+            if (m_reused)
+                return send();
+
+            m_conn = std::make_unique<connection>(
+                        m_api.m_io_context, m_api.m_ssl_context);
+            auto& ssl_sock = m_conn->stream;
+            if (m_api.m_verify_peer) {
+                ssl_sock.set_verify_mode(ssl::verify_peer);
+                ssl_sock.set_verify_callback(
+                            ssl::host_name_verification(m_api.m_host));
+            } else {
+                ssl_sock.set_verify_mode(ssl::verify_none);
+            }
+
+            if (!SSL_set_tlsext_host_name(ssl_sock.native_handle(),
+                                          m_api.m_host.c_str()))
+                return fail(system::error_code(
+                                static_cast<int>(::ERR_get_error()),
+                                asio::error::get_ssl_category()));
+
+            // resolving host:port, from cache unless it is the first time
+
+            m_phase.restart();
+            m_api.m_resolver.async_endpoints(
+                        [self = shared_from_this()]
+                        (system::error_code ec,
+                         resolver_cache::results_type results) {
+                self->on_resolve(ec, std::move(results));
+            });
+        }
+
+    private:
+        void on_resolve (system::error_code ec,
+                         resolver_cache::results_type results) {
+            if (cancelled())
+                ec = asio::error::operation_aborted;
+            if (ec)
+                return fail(ec);
+
+            m_phase.lap(phase::dns, m_api.m_metrics);
+
+            // connecting
+
+            asio::async_connect(m_conn->stream.lowest_layer(), results,
+                        [self = shared_from_this()]
+                        (system::error_code ec, tcp::endpoint endpoint) {
+                self->on_connect(ec, endpoint);
+            });
+        }
+
+        void on_connect (system::error_code ec, tcp::endpoint endpoint) {
+            if (cancelled())
+                ec = asio::error::operation_aborted;
+            if (ec)
+                return fail(ec);
+
+            m_phase.lap(phase::connect, m_api.m_metrics);
+
+            // ssl handshake, resuming the last session if we have one
+
+            m_api.m_pool.resume_session(*m_conn);
+            m_conn->stream.async_handshake(ssl::stream_base::client,
+                        [self = shared_from_this()](system::error_code ec) {
+                self->on_handshake(ec);
+            });
+        }
+
+        void on_handshake (system::error_code ec) {
+            if (cancelled())
+                ec = asio::error::operation_aborted;
+            if (ec)
+                return fail(ec);
+
+            m_phase.lap(phase::tls, m_api.m_metrics);
+            m_api.m_pool.handshake_done(*m_conn);
+
+            DICT_TRACE_INSTANT("tls.resumed", "resumed",
+                               SSL_session_reused(m_conn->stream.native_handle()));
+
+            send();
+        }
+
+        void send () {
+            // sending request, the time to first byte starts now
+
+            m_phase.restart();
+            http::async_write(m_conn->stream, m_req,
+                        [self = shared_from_this()]
+                        (system::error_code ec, std::size_t sent) {
+                self->on_write(ec, sent);
+            });
+        }
+
+        void on_write (system::error_code ec, std::size_t sent) {
+            if (cancelled())
+                ec = asio::error::operation_aborted;
+            if (ec)
+                return fail(ec);
+
+            DICT_TRACE_INSTANT("http.sent", "bytes", sent);
+            m_api.m_metrics.sent(sent);
+
+            // read reply, the header first
+
+            m_parser.emplace();
+            m_raw.clear();
+            auto& body = m_parser->get().body();
+            body.context = &m_conn->parse;
+            if (m_api.m_cache)
+                body.raw = &m_raw;
+            if (m_on_entry)
+                body.on_element = [this](json::value&& entry) {
+                    on_entry(std::move(entry));
+                };
+            http::async_read_header(m_conn->stream, m_conn->buffer, *m_parser,
+                        [self = shared_from_this()]
+                        (system::error_code ec, std::size_t read) {
+                self->on_header(ec, read);
+            });
+        }
+
+        void on_header (system::error_code ec, std::size_t read) {
+            if (cancelled())
+                ec = asio::error::operation_aborted;
+            if (ec)
+                return fail(ec);
+
+            m_phase.lap(phase::ttfb, m_api.m_metrics);
+            m_api.m_metrics.received(read);
+
+            // then the body, parsed as it arrives
+
+            http::async_read(m_conn->stream, m_conn->buffer, *m_parser,
+                        [self = shared_from_this()]
+                        (system::error_code ec, std::size_t read) {
+                self->on_read(ec, read);
+            });
+        }
+
+        void on_read (system::error_code ec, std::size_t read) {
+            if (cancelled())
+                ec = asio::error::operation_aborted;
+            if (ec)
+                return fail(ec);
+
+            m_phase.lap(phase::body, m_api.m_metrics);
+            m_api.m_metrics.received(read);
+
+            DICT_TRACE_INSTANT("http.received", "bytes", read);
+
+            auto& res = m_parser->get();
+            ++m_conn->requests;
+            if (res.keep_alive())
+                m_api.m_pool.release(std::move(m_conn));
+            m_conn.reset();
+
+            if (m_api.m_cache && res.result() == http::status::ok)
+                m_api.m_cache->store(m_key, m_raw);
+
+            finish(res.body().json);
+        }
+
+        void on_entry (json::value&& entry) {
+            // a result of its own, allocated in the same arena of the entry
+
+            json::array array(entry.storage());
+            array.push_back(std::move(entry));
+            auto r = std::make_shared<const result>(json::value(std::move(array)));
+            m_parts.push_back(r);
+
+            if (r->entries().empty())
+                return;
+
+            DICT_TRACE_INSTANT("lookup.entry", "index", m_parts.size());
+
+            try {
+                m_on_entry(std::move(r));
+            } catch (std::exception const& ex) {
+                BOOST_LOG_TRIVIAL(error)
+                        << "Entry handler for <" << m_word
+                        << "> throws: " << ex.what();
+            }
+        }
+
+        bool lookup_compiled () {
+            if (!m_api.m_compiled || m_ref != 0)
+                return false;
+
+            auto t = m_api.m_compiled->find(normalize(m_word));
+            if (!t)
+                return false;
+
+            DICT_TRACE_INSTANT("lookup.compiled", nullptr, 0);
+
+            // its headwords are already known
+            m_phase.restart();
+            auto r = compiled_result(m_api.m_compiled, *t).to_result();
+            m_phase.lap(phase::build, m_api.m_metrics);
+            complete(nullptr, std::move(r));
+            return true;
+        }
+
+        bool lookup_cache () {
+            if (!m_api.m_cache)
+                return false;
+
+            // offline we are happy with a stale response too
+            auto max_age = m_api.m_offline
+                    ? response_cache::clock::duration::max()
+                    : response_cache::clock::duration(m_api.m_cache_max_age);
+
+            json::value json;
+            system::error_code ec;
+            bool found = m_api.m_cache->find(m_key, max_age,
+                                             [&](std::string_view body) {
+                DICT_TRACE_SCOPE("response_cache.parse");
+                json = json::parse(body, ec);
+            });
+
+            if (!found || ec)
+                return false;
+
+            DICT_TRACE_INSTANT("lookup.response_cache", nullptr, 0);
+
+            finish(json);
+            return true;
+        }
+
+        void finish (json::value& json) {
+            m_phase.restart();
+
+            try {
+                // entries received one at a time are only joined
+
+                result_ptr r;
+                if (!m_parts.empty()) {
+                    r = std::make_shared<const result>(std::move(m_parts));
+                } else {
+                    // if the result is an array of strings, throws suggestions
+
+                    if (json.as_array().at(0).is_string()) {
+                        suggestions s(json);
+                        for (auto& term : s)
+                            m_api.m_index.insert(normalize(term));
+                        throw s;
+                    }
+
+                    r = std::make_shared<const result>(std::move(json));
+                }
+
+                m_phase.lap(phase::build, m_api.m_metrics);
+
+                // return the result, keeping its headwords for the next time
+
+                for (auto& e : r->entries())
+                    m_api.m_index.insert(normalize(e.get_headword()));
+
+                complete(nullptr, std::move(r));
+            } catch (...) {
+                complete(std::current_exception(), nullptr);
+            }
+        }
+
+        void cancel () {
+            BOOST_LOG_TRIVIAL(trace)
+                    << "Request for term <" << m_word << "> cancelled";
+
+            // pending operations complete with operation_aborted
+            if (m_conn)
+                m_conn->close();
+        }
+
+        bool cancelled () const {
+            return m_cancel && m_cancel->cancelled();
+        }
+
+        void fail (system::error_code ec) {
+            // the server may have closed an idle connection in the
+            // meanwhile: a GET is idempotent, so retry on a fresh one
+
+            if (m_reused && m_retry && m_parts.empty() && !cancelled()
+                    && is_stale(ec)) {
+                BOOST_LOG_TRIVIAL(trace)
+                        << "Pooled connection was closed (" << ec.message()
+                        << "), reconnecting";
+                m_api.m_pool.reconnected();
+                m_retry = false;
+                m_conn.reset();
+                return run();
+            }
+
+            if (m_conn)
+                m_conn->close();
+            m_conn.reset();
+
+            complete(std::make_exception_ptr(system::system_error(ec)), nullptr);
+        }
+
+        void complete (std::exception_ptr e, result_ptr r) {
+            if (m_cancel)
+                m_cancel->on_cancel(nullptr);
+            auto handler = std::move(m_handler);
+            handler(e, std::move(r));
+        }
+
+        static bool is_stale (system::error_code const& ec) {
+            return ec == http::error::end_of_stream
+                || ec == asio::error::eof
+                || ec == asio::error::connection_reset
+                || ec == asio::error::broken_pipe
+                || ec == ssl::error::stream_truncated;
+        }
+    };
+
+    /// A term looked up in every reference at once, by a session each,
+    /// after the parsed results and the local suggestions. The results are
+    /// merged in the order of the references; when none has any entry, the
+    /// outcome is the first suggestions, or else the first error. A
+    /// reference that misses its deadline is cancelled and dropped.
+    class lookup : public std::enable_shared_from_this<lookup> {
+    private:
+        struct part {
+            std::shared_ptr<cancellation> cancel = std::make_shared<cancellation>();
+            std::unique_ptr<asio::steady_timer> deadline;
+            std::exception_ptr error;
+            result_ptr result;
+            bool done = false;
+        };
+
+        api& m_api;
+        const std::string m_word, m_key, m_result_key;
+        entry_handler m_on_entry;
+        std::shared_ptr<cancellation> m_cancel;
+        handler_type m_handler;
+        std::vector<part> m_parts;
+        std::size_t m_pending = 0;
+
+        // the whole lookup
+        stopwatch m_total;
+
+    public:
+        lookup (api& api, std::string word, entry_handler on_entry,
+                std::shared_ptr<cancellation> cancel, handler_type handler):
+            m_api(api)
+          , m_word(std::move(word))
+          , m_key(normalize(m_word))
+          , m_result_key(api.result_key(m_key))
+          , m_on_entry(std::move(on_entry))
+          , m_cancel(std::move(cancel))
+          , m_handler(std::move(handler))
+        {}
+
+        void run () {
+            if (m_cancel && m_cancel->cancelled())
+                return complete(std::make_exception_ptr(
+                                    system::system_error(asio::error::operation_aborted)),
+                                nullptr);
+
+            if (auto cached = m_api.m_results.get(m_result_key)) {
+                DICT_TRACE_INSTANT("lookup.result_cache", nullptr, 0);
+                return complete(nullptr, std::move(cached));
+            }
+
+            if (suggest_locally())
+                return;
+
+            // every part has its own cancellation, so that a deadline only
+            // cancels its own session
+
+            auto& references = m_api.m_references;
+            m_parts.resize(references.size());
+            m_pending = m_parts.size();
+
+            if (m_cancel)
+                m_cancel->on_cancel([weak = weak_from_this()]{
+                    if (auto self = weak.lock())
+                        for (auto& p : self->m_parts)
+                            p.cancel->cancel();
+                });
+
+            for (std::size_t i = 0; i < m_parts.size(); ++i) {
+                if (references[i].deadline.count() <= 0)
+                    continue;
+                auto& timer = m_parts[i].deadline;
+                timer = std::make_unique<asio::steady_timer>(
+                            m_api.m_io_context, references[i].deadline);
+                timer->async_wait([weak = weak_from_this(), i]
+                                  (system::error_code ec) {
+                    if (auto self = weak.lock(); self && !ec)
+                        self->expire(i);
+                });
+            }
+
+            // a session found in a cache completes right away, but the
+            // parts are only merged once every one has started
+            for (std::size_t i = 0; i < m_parts.size(); ++i)
+                std::make_shared<session>(m_api, i, m_word, m_on_entry,
+                                          m_parts[i].cancel,
+                                          [self = shared_from_this(), i]
+                                          (std::exception_ptr e, result_ptr r) {
+                    self->on_part(i, e, std::move(r));
+                })->run();
+        }
+
+    private:
+        // a term missing from a complete lexicon (the word list) that has
+        // terms close to it is misspelled: those are the suggestions, and
+        // the service is only asked when there is none; offline, any is
+        // better than nothing
+        bool suggest_locally () {
+            if (!m_api.m_lexicon && !m_api.m_offline)
+                return false;
+
+            m_api.index_compiled_terms();
+            if (m_api.m_index.contains(m_key))
+                return false;
+
+            auto terms = m_api.m_index.suggest(m_key, max_suggestions);
+            if (terms.empty())
+                return false;
+
+            DICT_TRACE_INSTANT("lookup.suggestions", "count", terms.size());
+
+            complete(std::make_exception_ptr(suggestions(std::move(terms))),
+                     nullptr);
+            return true;
+        }
+
+
+        void expire (std::size_t i) {
+            auto& p = m_parts[i];
+            if (p.done)
+                return;
+
+            BOOST_LOG_TRIVIAL(trace)
+                    << "Reference " << m_api.m_references[i].name
+                    << " missed its deadline for term <" << m_word << ">";
+            DICT_TRACE_INSTANT("lookup.deadline", "reference", i);
+
+            // whatever the session does next is ignored
+            p.cancel->cancel();
+            on_part(i, std::make_exception_ptr(
+                        system::system_error(asio::error::timed_out)), nullptr);
+        }
+
+        void on_part (std::size_t i, std::exception_ptr e, result_ptr r) {
+            auto& p = m_parts[i];
+            if (p.done)
+                return;
+
+            p.done = true;
+            p.error = e;
+            p.result = std::move(r);
+            if (p.deadline)
+                p.deadline->cancel();
+
+            if (--m_pending == 0)
+                merge();
+        }
+
+        void merge () {
+            std::vector<result_ptr> found;
+            for (auto& p : m_parts)
+                if (p.result && !p.result->entries().empty())
+                    found.push_back(p.result);
+
+            if (found.empty()) {
+                for (auto& p : m_parts)
+                    if (p.error && is_suggestions(p.error))
+                        return complete(p.error, nullptr);
+                for (auto& p : m_parts)
+                    if (p.result)
+                        return complete(nullptr, p.result);
+                return complete(m_parts.front().error, nullptr);
+            }
+
+            auto r = found.size() == 1
+                    ? found.front()
+                    : std::make_shared<const result>(std::move(found));
+
+            // keeping the result for the next time, unless a reference
+            // missed its deadline or failed: the next lookup may get it whole
+            bool whole = std::all_of(m_parts.begin(), m_parts.end(), [](auto& p) {
+                return !p.error || is_suggestions(p.error);
+            });
+            if (whole)
+                m_api.m_results.put(m_result_key, r, r->memory_footprint());
+            if (m_api.m_text)
+                m_api.index_text(m_key, *r);
+            complete(nullptr, std::move(r));
+        }
+
+        void complete (std::exception_ptr e, result_ptr r) {
+            if (m_cancel)
+                m_cancel->on_cancel(nullptr);
+            m_total.lap(phase::lookup, m_api.m_metrics);
+            auto handler = std::move(m_handler);
+            handler(e, std::move(r));
+        }
+
+        static bool is_suggestions (std::exception_ptr e) {
+            try {
+                std::rethrow_exception(e);
+            } catch (suggestions const&) {
+                return true;
+            } catch (...) {
+                return false;
+            }
+        }
+    };
+
+    /// Concurrent requests of the same term share a single lookup, and so
+    /// the same result or exception: the first one starts it, the others
+    /// join it. The lookup is only cancelled if every request is. Entries
+    /// are always received one at a time, whoever started the lookup, so
+    /// that a request with an entry handler that joins later still gets
+    /// them: first the ones received so far, then the others.
+    class flight : public std::enable_shared_from_this<flight> {
+    private:
+        struct waiter {
+            entry_handler on_entry;
+            std::shared_ptr<cancellation> cancel;
+            handler_type handler;
+        };
+
+        api& m_api;
+        const std::string m_key;
+        const std::shared_ptr<cancellation> m_cancel;
+        std::list<waiter> m_waiters;
+        std::vector<result_ptr> m_entries;
+
+    public:
+        flight (api& api, std::string key):
+            m_api(api)
+          , m_key(std::move(key))
+          , m_cancel(std::make_shared<cancellation>())
+        {}
+
+        void join (entry_handler on_entry, std::shared_ptr<cancellation> cancel,
+                   handler_type handler) {
+            // catch up with the entries received so far
+            for (auto& entry : m_entries)
+                deliver(on_entry, entry);
+
+            auto it = m_waiters.insert(m_waiters.end(),
+                        {std::move(on_entry), cancel, std::move(handler)});
+
+            if (cancel)
+                cancel->on_cancel([weak = weak_from_this(), it]{
+                    if (auto self = weak.lock())
+                        self->leave(it);
+                });
+        }
+
+        void run (std::string word) {
+            entry_handler on_entry = [self = shared_from_this()](result_ptr entry) {
+                self->on_entry(std::move(entry));
+            };
+
+            std::make_shared<lookup>(m_api, std::move(word), std::move(on_entry),
+                                     m_cancel,
+                                     [self = shared_from_this()]
+                                     (std::exception_ptr e, result_ptr r) {
+                self->complete(e, std::move(r));
+            })->run();
+        }
+
+    private:
+        void on_entry (result_ptr entry) {
+            m_entries.push_back(entry);
+            for (auto& w : m_waiters)
+                deliver(w.on_entry, entry);
+        }
+
+        void leave (std::list<waiter>::iterator it) {
+            auto w = std::move(*it);
+            m_waiters.erase(it);
+
+            // nobody is waiting anymore: a new lookup starts a new flight
+            if (m_waiters.empty()) {
+                forget();
+                m_cancel->cancel();
+            }
+
+            w.handler(std::make_exception_ptr(
+                          system::system_error(asio::error::operation_aborted)),
+                      nullptr);
+        }
+
+        void complete (std::exception_ptr e, result_ptr r) {
+            forget();
+
+            auto waiters = std::move(m_waiters);
+            m_waiters.clear();
+            for (auto& w : waiters) {
+                if (w.cancel)
+                    w.cancel->on_cancel(nullptr);
+                w.handler(e, r);
+            }
+        }
+
+        void forget () {
+            auto it = m_api.m_flights.find(m_key);
+            if (it != m_api.m_flights.end() && it->second.get() == this)
+                m_api.m_flights.erase(it);
+        }
+
+        void deliver (entry_handler const& on_entry, result_ptr const& entry) {
+            if (!on_entry)
+                return;
+            try {
+                on_entry(entry);
+            } catch (std::exception const& ex) {
+                BOOST_LOG_TRIVIAL(error)
+                        << "Entry handler for <" << m_key
+                        << "> throws: " << ex.what();
+            }
+        }
+    };
+
+    class batch : public std::enable_shared_from_this<batch> {
+    private:
+        api& m_api;
+        const std::vector<std::string> m_words;
+        outcome_handler m_on_outcome;
+        std::function<void()> m_done;
+        std::size_t m_next = 0, m_active = 0;
+
+    public:
+        batch (api& api, std::vector<std::string> words,
+               outcome_handler on_outcome, std::function<void()> done):
+            m_api(api)
+          , m_words(std::move(words))
+          , m_on_outcome(std::move(on_outcome))
+          , m_done(std::move(done))
+        {}
+
+        void run (std::size_t concurrency) {
+            BOOST_LOG_TRIVIAL(trace)
+                    << "Batch of " << m_words.size() << " terms, "
+                    << concurrency << " at a time";
+
+            while (m_active < concurrency && m_next < m_words.size())
+                launch();
+
+            if (m_active == 0)
+                m_done();
+        }
+
+    private:
+        void launch () {
+            auto i = m_next++;
+            ++m_active;
+            m_api.start(m_words[i], nullptr, nullptr, [self = shared_from_this(), i]
+                        (std::exception_ptr e, result_ptr r) {
+                self->on_outcome(i, e, std::move(r));
+            });
+        }
+
+        void on_outcome (std::size_t i, std::exception_ptr e, result_ptr r) {
+            --m_active;
+
+            try {
+                m_on_outcome(m_words[i], e, std::move(r));
+            } catch (std::exception const& ex) {
+                BOOST_LOG_TRIVIAL(error)
+                        << "Batch outcome handler for <" << m_words[i]
+                        << "> throws: " << ex.what();
+            }
+
+            if (m_next < m_words.size())
+                launch();
+            else if (m_active == 0)
+                m_done();
+        }
+    };
+
+    void start (std::string word, entry_handler on_entry,
+                std::shared_ptr<cancellation> cancel, handler_type handler) {
+        asio::post(m_io_context,
+                   [this, word = std::move(word), on_entry = std::move(on_entry),
+                    cancel = std::move(cancel), handler = std::move(handler)]
+                   () mutable {
+            if (cancel && cancel->cancelled())
+                return handler(std::make_exception_ptr(
+                                   system::system_error(asio::error::operation_aborted)),
+                               nullptr);
+
+            // join the lookup of the same term, if there is one in flight
+
+            auto key = normalize(word);
+            auto& f = m_flights[key];
+            bool const first = !f;
+            if (first) {
+                f = std::make_shared<flight>(*this, key);
+            } else {
+                ++m_coalesced;
+                BOOST_LOG_TRIVIAL(trace)
+                        << "Joining the lookup of term <" << key << ">";
+            }
+
+            auto joined = f;
+            joined->join(std::move(on_entry), std::move(cancel), std::move(handler));
+            if (first)
+                joined->run(std::move(word));
+        });
     }
 };
 
@@ -0,0 +1,530 @@
+/**
+ * @file flat_result.hpp
+ * @brief Compact result extracted by a selective SAX parser
+ * @author Giuseppe Roberti <inbox> <at> <roberti> <dot> <dev>
+ */
+#ifndef FLAT_RESULT_HPP
+#define FLAT_RESULT_HPP
+
+#include "dict.hpp"
+
+#include <boost/beast/http.hpp>
+#include <boost/json/basic_parser.hpp>
+
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace dict {
+
+/// A flat result is made of a single string arena plus arrays of records
+/// pointing into it: entries own a range of senses, senses own their number
+/// and text. Records are plain data, so they can also live in a mapped file.
+struct flat_span {
+    static constexpr std::uint32_t npos = std::uint32_t(-1);
+
+    std::uint32_t offset = npos;
+    std::uint32_t size = 0;
+
+    bool empty () const {
+        return offset == npos;
+    }
+};
+
+struct flat_entry {
+    std::uint32_t first_sense;
+    std::uint32_t sense_count;
+};
+
+struct flat_sense {
+    std::uint32_t type;
+    flat_span sn;
+    flat_span text;
+};
+
+/// Non owning access to the arrays of a flat result.
+class flat_view {
+private:
+    std::string_view m_arena;
+    flat_entry const* m_entries = nullptr;
+    std::size_t m_entry_count = 0;
+    flat_sense const* m_senses = nullptr;
+    std::size_t m_sense_count = 0;
+    flat_span const* m_suggestions = nullptr;
+    std::size_t m_suggestion_count = 0;
+
+public:
+    class sense_ref {
+    private:
+        std::string_view m_arena;
+        flat_sense const& m_sense;
+
+    public:
+        sense_ref (std::string_view arena, flat_sense const& sense):
+            m_arena(arena), m_sense(sense)
+        {}
+
+        const char* get_type () const {
+            return sense::type_name(static_cast<sense::type>(m_sense.type));
+        }
+
+        std::optional<std::string_view> get_sn () const {
+            if (m_sense.sn.empty())
+                return std::nullopt;
+            return m_arena.substr(m_sense.sn.offset, m_sense.sn.size);
+        }
+
+        std::string_view get_text () const {
+            if (m_sense.text.empty())
+                return {};
+            return m_arena.substr(m_sense.text.offset, m_sense.text.size);
+        }
+    };
+
+    class entry_ref {
+    private:
+        flat_view const& m_view;
+        flat_entry const& m_entry;
+
+    public:
+        entry_ref (flat_view const& view, flat_entry const& entry):
+            m_view(view), m_entry(entry)
+        {}
+
+        std::size_t size () const {
+            return m_entry.sense_count;
+        }
+
+        sense_ref operator[] (std::size_t i) const {
+            return m_view.sense(m_entry.first_sense + i);
+        }
+    };
+
+    flat_view () = default;
+
+    flat_view (std::string_view arena,
+               flat_entry const* entries, std::size_t entry_count,
+               flat_sense const* senses, std::size_t sense_count,
+               flat_span const* suggestions, std::size_t suggestion_count):
+        m_arena(arena)
+      , m_entries(entries), m_entry_count(entry_count)
+      , m_senses(senses), m_sense_count(sense_count)
+      , m_suggestions(suggestions), m_suggestion_count(suggestion_count)
+    {}
+
+    std::size_t entry_count () const {
+        return m_entry_count;
+    }
+
+    entry_ref entry (std::size_t i) const {
+        return {*this, m_entries[i]};
+    }
+
+    std::size_t sense_count () const {
+        return m_sense_count;
+    }
+
+    sense_ref sense (std::size_t i) const {
+        return {m_arena, m_senses[i]};
+    }
+
+    /// True when the service answered with suggestions instead of entries.
+    bool is_suggestions () const {
+        return m_suggestion_count > 0;
+    }
+
+    std::vector<std::string> suggestions () const {
+        std::vector<std::string> out;
+        out.reserve(m_suggestion_count);
+        for (std::size_t i = 0; i < m_suggestion_count; ++i)
+            out.emplace_back(m_arena.substr(m_suggestions[i].offset,
+                                            m_suggestions[i].size));
+        return out;
+    }
+};
+
+class flat_result {
+private:
+    std::string m_arena;
+    std::vector<flat_entry> m_entries;
+    std::vector<flat_sense> m_senses;
+    std::vector<flat_span> m_suggestions;
+
+    friend class flat_handler;
+
+public:
+    flat_view view () const {
+        return {m_arena,
+                m_entries.data(), m_entries.size(),
+                m_senses.data(), m_senses.size(),
+                m_suggestions.data(), m_suggestions.size()};
+    }
+
+    /// Approximate bytes of memory owned by this result.
+    std::size_t memory_footprint () const {
+        return sizeof(*this) + m_arena.capacity()
+                + m_entries.capacity() * sizeof(flat_entry)
+                + m_senses.capacity() * sizeof(flat_sense)
+                + m_suggestions.capacity() * sizeof(flat_span);
+    }
+
+    void clear () {
+        m_arena.clear();
+        m_entries.clear();
+        m_senses.clear();
+        m_suggestions.clear();
+    }
+
+    /// Parse a whole Merriam-Webster response.
+    static flat_result parse (std::string_view json, system::error_code& ec);
+};
+
+/// Handler for json::basic_parser: it follows the path
+/// [ { "def": [ { "sseq": [ [ [ "sense", { "sn", "dt": [ [ "text", ... ] ] } ] ] ] } ] } ]
+/// (with "pseq" nesting more pairs) and only copies the sense numbers and
+/// texts into the arena; everything else is skipped while it streams by.
+class flat_handler {
+public:
+    static constexpr std::size_t max_object_size = std::size_t(-1);
+    static constexpr std::size_t max_array_size = std::size_t(-1);
+    static constexpr std::size_t max_key_size = std::size_t(-1);
+    static constexpr std::size_t max_string_size = std::size_t(-1);
+
+private:
+    enum class node : std::uint8_t {
+        ignore,
+        root,
+        entry,
+        defs,
+        def,
+        sseq,
+        sseq_item,
+        pseq,
+        pair,
+        sense,
+        dt,
+        dt_pair
+    };
+
+    enum class label : std::uint8_t {
+        none,
+        sense,
+        pseq,
+        text,
+        other
+    };
+
+    enum class target : std::uint8_t {
+        none,
+        label,
+        sn,
+        text,
+        suggestion
+    };
+
+    struct frame {
+        node kind;
+        std::uint32_t index = 0;
+        label pair_label = label::none;
+        std::uint32_t first_sense = 0;
+        bool flag_a = false;    // entry: has def, def: has vd
+        bool flag_b = false;    // def: has sls
+    };
+
+    flat_result* m_result = nullptr;
+    std::vector<frame> m_stack;
+    std::string m_key;
+    std::string m_scratch;
+    target m_target = target::none;
+    bool m_in_string = false;
+    std::uint32_t m_string_offset = 0;
+    std::size_t m_current_sense = 0;
+
+public:
+    flat_handler () = default;
+
+    explicit flat_handler (flat_result& result):
+        m_result(&result)
+    {}
+
+    void reset (flat_result& result) {
+        m_result = &result;
+        m_stack.clear();
+        m_key.clear();
+        m_target = target::none;
+        m_in_string = false;
+    }
+
+    bool on_document_begin (system::error_code&) { return true; }
+    bool on_document_end (system::error_code&) { return true; }
+
+    bool on_array_begin (system::error_code&) {
+        m_stack.push_back({child(true)});
+        return true;
+    }
+
+    bool on_array_end (std::size_t, system::error_code&) {
+        m_stack.pop_back();
+        value_done();
+        return true;
+    }
+
+    bool on_object_begin (system::error_code&) {
+        frame f{child(false)};
+
+        if (f.kind == node::def || f.kind == node::entry)
+            f.first_sense = m_result->m_senses.size();
+
+        if (f.kind == node::sense) {
+            m_current_sense = m_result->m_senses.size();
+            m_result->m_senses.push_back({});
+        }
+
+        m_stack.push_back(f);
+        return true;
+    }
+
+    bool on_object_end (std::size_t, system::error_code&) {
+        frame f = m_stack.back();
+        m_stack.pop_back();
+
+        if (f.kind == node::def) {
+            auto t = f.flag_a ? sense::type::verb
+                   : f.flag_b ? sense::type::sls
+                   : sense::type::noun;
+            for (auto i = f.first_sense; i < m_result->m_senses.size(); ++i)
+                m_result->m_senses[i].type = static_cast<std::uint32_t>(t);
+        } else if (f.kind == node::entry && f.flag_a) {
+            m_result->m_entries.push_back(
+                        {f.first_sense,
+                         std::uint32_t(m_result->m_senses.size() - f.first_sense)});
+        }
+
+        value_done();
+        return true;
+    }
+
+    bool on_string_part (json::string_view s, std::size_t, system::error_code&) {
+        string_part(s);
+        return true;
+    }
+
+    bool on_string (json::string_view s, std::size_t, system::error_code&) {
+        string_part(s);
+        string_done();
+        m_in_string = false;
+        value_done();
+        return true;
+    }
+
+    bool on_key_part (json::string_view s, std::size_t n, system::error_code&) {
+        // n counts the key so far: when it matches, this is the first part
+        if (n == s.size())
+            m_key.assign(s.data(), s.size());
+        else
+            m_key.append(s.data(), s.size());
+        return true;
+    }
+
+    bool on_key (json::string_view s, std::size_t n, system::error_code&) {
+        if (n == s.size())
+            m_key.assign(s.data(), s.size());
+        else
+            m_key.append(s.data(), s.size());
+
+        auto& top = m_stack.back();
+        if (top.kind == node::def) {
+            if (m_key == "vd")
+                top.flag_a = true;
+            else if (m_key == "sls")
+                top.flag_b = true;
+        } else if (top.kind == node::entry && m_key == "def") {
+            top.flag_a = true;
+        }
+        return true;
+    }
+
+    bool on_number_part (json::string_view, system::error_code&) { return true; }
+    bool on_int64 (std::int64_t, json::string_view, system::error_code&) { return scalar(); }
+    bool on_uint64 (std::uint64_t, json::string_view, system::error_code&) { return scalar(); }
+    bool on_double (double, json::string_view, system::error_code&) { return scalar(); }
+    bool on_bool (bool, system::error_code&) { return scalar(); }
+    bool on_null (system::error_code&) { return scalar(); }
+    bool on_comment_part (json::string_view, system::error_code&) { return true; }
+    bool on_comment (json::string_view, system::error_code&) { return true; }
+
+private:
+    /// The kind of the value that starts now, given where we are.
+    node child (bool is_array) const {
+        if (m_stack.empty())
+            return is_array ? node::root : node::ignore;
+
+        auto const& top = m_stack.back();
+
+        switch (top.kind) {
+        case node::root:
+            return is_array ? node::ignore : node::entry;
+        case node::entry:
+            return is_array && m_key == "def" ? node::defs : node::ignore;
+        case node::defs:
+            return is_array ? node::ignore : node::def;
+        case node::def:
+            return is_array && m_key == "sseq" ? node::sseq : node::ignore;
+        case node::sseq:
+            return is_array ? node::sseq_item : node::ignore;
+        case node::sseq_item:
+        case node::pseq:
+            return is_array ? node::pair : node::ignore;
+        case node::pair:
+            if (top.index != 1)
+                return node::ignore;
+            if (!is_array && top.pair_label == label::sense)
+                return node::sense;
+            if (is_array && top.pair_label == label::pseq)
+                return node::pseq;
+            return node::ignore;
+        case node::sense:
+            return is_array && m_key == "dt" ? node::dt : node::ignore;
+        case node::dt:
+            return is_array ? node::dt_pair : node::ignore;
+        default:
+            return node::ignore;
+        }
+    }
+
+    target string_target () const {
+        if (m_stack.empty())
+            return target::none;
+
+        auto const& top = m_stack.back();
+
+        switch (top.kind) {
+        case node::root:
+            return target::suggestion;
+        case node::pair:
+            return top.index == 0 ? target::label : target::none;
+        case node::sense:
+            return m_key == "sn" ? target::sn : target::none;
+        case node::dt_pair:
+            if (top.index == 0)
+                return target::label;
+            if (top.index == 1 && top.pair_label == label::text
+                    && m_result->m_senses[m_current_sense].text.empty())
+                return target::text;
+            return target::none;
+        default:
+            return target::none;
+        }
+    }
+
+    void string_part (json::string_view s) {
+        if (!m_in_string) {
+            m_in_string = true;
+            m_target = string_target();
+            m_string_offset = m_result->m_arena.size();
+            m_scratch.clear();
+        }
+
+        switch (m_target) {
+        case target::label:
+            m_scratch.append(s.data(), s.size());
+            break;
+        case target::sn:
+        case target::text:
+        case target::suggestion:
+            m_result->m_arena.append(s.data(), s.size());
+            break;
+        case target::none:
+            break;
+        }
+    }
+
+    void string_done () {
+        flat_span span{m_string_offset,
+                       std::uint32_t(m_result->m_arena.size() - m_string_offset)};
+
+        switch (m_target) {
+        case target::label: {
+            auto& top = m_stack.back();
+            top.pair_label = m_scratch == "sense" ? label::sense
+                           : m_scratch == "pseq" ? label::pseq
+                           : m_scratch == "text" ? label::text
+                           : label::other;
+            break;
+        }
+        case target::sn:
+            m_result->m_senses[m_current_sense].sn = span;
+            break;
+        case target::text:
+            m_result->m_senses[m_current_sense].text = span;
+            break;
+        case target::suggestion:
+            m_result->m_suggestions.push_back(span);
+            break;
+        case target::none:
+            break;
+        }
+
+        m_target = target::none;
+    }
+
+    bool scalar () {
+        value_done();
+        return true;
+    }
+
+    void value_done () {
+        if (!m_stack.empty())
+            ++m_stack.back().index;
+    }
+};
+
+inline flat_result flat_result::parse (std::string_view json, system::error_code& ec) {
+    flat_result result;
+    json::basic_parser<flat_handler> parser(json::parse_options{}, result);
+    parser.write_some(false, json.data(), json.size(), ec);
+    if (!ec && !parser.done())
+        ec = json::error::incomplete;
+    return result;
+}
+
+/// Beast body that parses a response straight into a flat_result.
+struct flat_json_body {
+    using value_type = flat_result;
+
+    struct reader {
+        template<bool isRequest, class Fields>
+        reader (http::header<isRequest, Fields>&, value_type& body):
+            m_parser(json::parse_options{}, body)
+        {}
+
+        void init (boost::optional<std::uint64_t> const& content_length,
+                   system::error_code& ec) {
+            ec = {};
+        }
+
+        template<class ConstBufferSequence>
+        std::size_t put (ConstBufferSequence const& buffers, system::error_code& ec) {
+            ec = {};
+            return m_parser.write_some(
+                        true, static_cast<const char*>(buffers.data()),
+                        buffers.size(), ec);
+        }
+
+        void finish (system::error_code& ec) {
+            ec = {};
+            m_parser.write_some(false, nullptr, 0, ec);
+            if (!ec && !m_parser.done())
+                ec = json::error::incomplete;
+        }
+
+    private:
+        json::basic_parser<flat_handler> m_parser;
+    };
+};
+
+} // namespace dict
+
+#endif // FLAT_RESULT_HPP
@@ -0,0 +1,140 @@
+/**
+ * @file fuzzy_index.hpp
+ * @brief Tries of the known terms, forward and reversed, to correct a misspelled term locally
+ * @author Giuseppe Roberti <inbox> <at> <roberti> <dot> <dev>
+ */
+#ifndef FUZZY_INDEX_HPP
+#define FUZZY_INDEX_HPP
+
+#include "prefix_index.hpp"
+
+#include <boost/log/trivial.hpp>
+
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <istream>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace dict {
+
+/// A prefix_index of the known terms, that completes them, and one of the
+/// same terms reversed. A term within two edits of another has one of its
+/// halves within one edit of the same part of the other: the first half
+/// is looked for in the forward trie and the second in the reversed one,
+/// so that neither walk has to try every possible couple of characters at
+/// its root. Thread-safe, like the tries.
+class fuzzy_index {
+private:
+    prefix_index m_forward;
+    prefix_index m_backward;
+
+public:
+    std::size_t size () const {
+        return m_forward.size();
+    }
+
+    /// Add a term, returning false if it was already there.
+    bool insert (std::string_view term) {
+        if (!m_forward.insert(term))
+            return false;
+        m_backward.insert(std::string(term.rbegin(), term.rend()));
+        return true;
+    }
+
+    /// Add a term per line of the stream, then compact the tries.
+    std::size_t load (std::istream& in) {
+        std::size_t added = 0;
+        std::string line;
+        while (std::getline(in, line)) {
+            if (!line.empty() && line.back() == '\r')
+                line.pop_back();
+            if (insert(line))
+                ++added;
+        }
+
+        m_forward.compact();
+        m_backward.compact();
+        return added;
+    }
+
+    std::size_t load_file (std::string const& path) {
+        std::ifstream in(path);
+        if (!in) {
+            BOOST_LOG_TRIVIAL(error)
+                    << "Unable to open word list " << path;
+            return 0;
+        }
+
+        auto added = load(in);
+        BOOST_LOG_TRIVIAL(trace)
+                << "Loaded " << added << " terms from " << path;
+        return added;
+    }
+
+    bool contains (std::string_view term) const {
+        return m_forward.contains(term);
+    }
+
+    /// See prefix_index::complete.
+    std::vector<std::string> complete (std::string_view prefix,
+                                       std::size_t max) const {
+        return m_forward.complete(prefix, max);
+    }
+
+    /// At most max other terms within radius_for(term) edits of term, the
+    /// closest first, then the ones of the most similar length.
+    std::vector<std::string> suggest (std::string_view term, std::size_t max) const {
+        std::vector<std::pair<std::size_t, std::string>> found;
+        auto radius = radius_for(term);
+
+        m_forward.within(term, radius, radius > 1 ? term.size() / 2 : 0,
+                         [&](std::string_view t, std::size_t d) {
+            if (d > 0)
+                found.emplace_back(d, t);
+        });
+        if (radius > 1) {
+            std::string reversed(term.rbegin(), term.rend());
+            m_backward.within(reversed, radius, term.size() - term.size() / 2,
+                              [&](std::string_view t, std::size_t d) {
+                if (d > 0)
+                    found.emplace_back(d, std::string(t.rbegin(), t.rend()));
+            });
+
+            // the terms close in both halves are found twice
+            std::sort(found.begin(), found.end(), [](auto const& a, auto const& b) {
+                return a.second < b.second;
+            });
+            found.erase(std::unique(found.begin(), found.end()), found.end());
+        }
+
+        auto gap = [&term](std::string const& t) {
+            return t.size() > term.size() ? t.size() - term.size() : term.size() - t.size();
+        };
+        auto n = std::min(max, found.size());
+        std::partial_sort(found.begin(), found.begin() + n, found.end(),
+                          [&](auto const& a, auto const& b) {
+            return std::make_tuple(a.first, gap(a.second), std::cref(a.second))
+                    < std::make_tuple(b.first, gap(b.second), std::cref(b.second));
+        });
+
+        std::vector<std::string> terms;
+        terms.reserve(n);
+        for (std::size_t i = 0; i < n; ++i)
+            terms.push_back(std::move(found[i].second));
+        return terms;
+    }
+
+    /// One edit for terms of up to five characters, two beyond.
+    static std::size_t radius_for (std::string_view term) {
+        return term.size() <= 5 ? 1 : 2;
+    }
+};
+
+} // namespace dict
+
+#endif // FUZZY_INDEX_HPP
@@ -16,17 +16,39 @@
 #ifndef BOOST_BEAST_EXAMPLE_JSON_BODY
 #define BOOST_BEAST_EXAMPLE_JSON_BODY
 
+#include "arena.hpp"
+#include "content_decoder.hpp"
+#include "trace.hpp"
+
 #include <boost/json.hpp>
 #include <boost/json/stream_parser.hpp>
 #include <boost/json/monotonic_resource.hpp>
 #include <boost/beast/http.hpp>
 #include <boost/asio/buffer.hpp>
 
+#include <functional>
+#include <memory>
+#include <new>
+#include <optional>
+#include <string>
+
 namespace json = boost::json;
 
 struct json_body
 {
-    using value_type = json::value;
+    struct value_type
+    {
+        json::value json;
+        // when set, the reader also appends here every byte of the body,
+        // once decoded if it has a Content-Encoding
+        std::string* raw = nullptr;
+        // when set and the body is an array, every object in it is passed
+        // here as soon as it is parsed, and only the other elements are kept
+        std::function<void(json::value&&)> on_element;
+        // when set, its parsers and arenas are used (eg: the ones of the
+        // connection), otherwise the reader makes its own
+        dict::parse_context* context = nullptr;
+    };
 
     struct writer
     {
@@ -36,7 +58,7 @@ struct json_body
                value_type const& body)
         {
             // The serializer holds a pointer to the value, so all we need to do is to reset it.
-            serializer.reset(&body);
+            serializer.reset(&body.json);
         }
 
         void
@@ -67,7 +89,17 @@ struct json_body
         template<bool isRequest, class Fields>
         reader(boost::beast::http::header<isRequest, Fields>& h, value_type& body)
             : body(body)
+            , own(body.context ? nullptr : std::make_unique<dict::parse_context>())
+            , context(body.context ? *body.context : *own)
+            , parser(context.parser)
+            , element(context.element)
         {
+            // a compressed body is decoded on the fly, as it is received
+            auto encoding = h[boost::beast::http::field::content_encoding];
+            auto coding = dict::content_decoder::parse(
+                        {encoding.data(), encoding.size()}, encoding_ec);
+            if (coding)
+                decoder.emplace(*coding);
         }
 
         void
@@ -75,39 +107,219 @@ struct json_body
             boost::optional<std::uint64_t> const& content_length,
             boost::system::error_code& ec)
         {
-            // If we know the content-length, we can allocate a monotonic resource to increase the parsing speed.
-            // We're using it rather then a static_resource, so a consumer can modify the resulting value.
-            // It is also only assumption that the parsed json will be smaller than the serialize one,
-            // it might not always be the case.
-            if (content_length)
-                parser.reset(json::make_shared_resource<json::monotonic_resource>(*content_length));
-            ec = {};
+            // Everything is parsed into a single arena, that lives as long as
+            // the values parsed into it; it is sized after the recent responses,
+            // or the content-length if it is larger.
+            storage = context.arenas->acquire(content_length ? *content_length : 0);
+            parser.reset(storage);
+            element.reset(storage);
+            others.emplace(storage);
+            ec = encoding_ec;
         }
 
         template<class ConstBufferSequence>
         std::size_t
         put(ConstBufferSequence const& buffers, boost::system::error_code& ec)
         {
+            DICT_TRACE_SCOPE("json.put");
             ec = {};
-            // The parser just uses the `ec` to indicate errors, so we don't need to do anything.
-            return parser.write_some(
-                static_cast<const char*>(buffers.data()), buffers.size(), ec);
+            auto const data = static_cast<const char*>(buffers.data());
+            if (!decoder)
+                return consume(data, buffers.size(), ec);
+
+            // every decoded chunk must be consumed, there is no going back
+            boost::system::error_code json_ec;
+            decoder->write(data, buffers.size(), [&](const char* out, std::size_t size) {
+                if (consume(out, size, json_ec) != size && !json_ec)
+                    json_ec = boost::json::error::extra_data;
+                return !json_ec;
+            }, ec);
+            if (json_ec)
+                ec = json_ec;
+            return buffers.size();
         }
 
         void
         finish(boost::system::error_code& ec)
         {
+            DICT_TRACE_SCOPE("json.finish");
             ec = {};
-            // We check manually if the json is complete.
-            if (parser.done())
-                body = parser.release();
-            else
+            if (decoder && !decoder->done()) {
+                ec = boost::beast::http::error::partial_message;
+                return;
+            }
+            if (body.on_element && !whole) {
+                if (root_done)
+                    set_json(std::move(*others));
+                else
+                    ec = boost::json::error::incomplete;
+            } else if (parser.done()) {
+                // We check manually if the json is complete.
+                set_json(parser.release());
+            } else {
                 ec = boost::json::error::incomplete;
+            }
+
+            if (!ec)
+                context.arenas->record(
+                        static_cast<dict::arena*>(storage.get())->used());
+
+            // the parsers outlive the response, with the connection: they
+            // must not keep the arena, so that it goes back to the pool as
+            // soon as the values parsed into it are gone
+            parser.reset();
+            element.reset();
         }
 
       private:
-        json::stream_parser parser;
+        // Assigning would copy the value into the storage of body.json:
+        // construct it in place instead, so that it stays in the arena.
+        void
+        set_json(json::value&& value)
+        {
+            body.json.~value();
+            ::new (&body.json) json::value(std::move(value));
+        }
+
+        std::size_t
+        consume(const char* data, std::size_t size, boost::system::error_code& ec)
+        {
+            std::size_t n;
+            if (body.on_element && !whole)
+                n = put_elements(data, size, ec);
+            else
+                // The parser just uses the `ec` to indicate errors, so we don't need to do anything.
+                n = parser.write_some(data, size, ec);
+            if (body.raw)
+                body.raw->append(data, n);
+            return n;
+        }
+
+        // Split the top level array in its elements, without parsing it:
+        // we only track strings and nesting, and each element is parsed on
+        // its own (in the arena of the response) so that it can be handed
+        // out at once.
+        std::size_t
+        put_elements(const char* data, std::size_t size, boost::system::error_code& ec)
+        {
+            std::size_t start = 0;
+
+            for (std::size_t i = 0; i < size; ++i) {
+                char const c = data[i];
+
+                if (root_done) {
+                    if (c != ' ' && c != '\t' && c != '\r' && c != '\n') {
+                        ec = boost::json::error::extra_data;
+                        return i;
+                    }
+                    continue;
+                }
+
+                if (in_string) {
+                    if (escaped)
+                        escaped = false;
+                    else if (c == '\\')
+                        escaped = true;
+                    else if (c == '"') {
+                        in_string = false;
+                        if (depth == 1 && in_element && !end_element(data + start, i + 1 - start, ec))
+                            return i + 1;
+                    }
+                    continue;
+                }
+
+                switch (c) {
+                case ' ': case '\t': case '\r': case '\n':
+                    break;
+                case '[': case '{':
+                    if (depth == 0 && c == '{') {
+                        // not an array: parse it as a whole
+                        whole = true;
+                        return i + parser.write_some(data + i, size - i, ec);
+                    }
+                    if (depth == 1 && !in_element) {
+                        in_element = true;
+                        start = i;
+                    }
+                    ++depth;
+                    break;
+                case ']': case '}':
+                    if (depth == 1 && in_element && !end_element(data + start, i - start, ec))
+                        return i;
+                    if (--depth == 0)
+                        root_done = true;
+                    if (depth == 1 && in_element && !end_element(data + start, i + 1 - start, ec))
+                        return i + 1;
+                    break;
+                case ',':
+                    if (depth == 1 && in_element && !end_element(data + start, i - start, ec))
+                        return i;
+                    break;
+                case '"':
+                    if (depth == 1 && !in_element) {
+                        in_element = true;
+                        start = i;
+                    }
+                    in_string = true;
+                    break;
+                default:
+                    if (depth == 0) {
+                        ec = boost::json::error::syntax;
+                        return i;
+                    }
+                    if (depth == 1 && !in_element) {
+                        in_element = true;
+                        start = i;
+                    }
+                    break;
+                }
+            }
+
+            if (in_element)
+                element.write_some(data + start, size - start, ec);
+
+            return size;
+        }
+
+        bool
+        end_element(const char* data, std::size_t size, boost::system::error_code& ec)
+        {
+            in_element = false;
+
+            element.write_some(data, size, ec);
+            if (!ec)
+                element.finish(ec);
+            if (ec)
+                return false;
+
+            json::value value = element.release();
+            element.reset(storage);
+
+            if (value.is_object())
+                body.on_element(std::move(value));
+            else
+                others->push_back(std::move(value));
+
+            return true;
+        }
+
         value_type& body;
+        std::unique_ptr<dict::parse_context> own;
+        dict::parse_context& context;
+        json::stream_parser& parser;
+        json::storage_ptr storage;
+        std::optional<dict::content_decoder> decoder;
+        boost::system::error_code encoding_ec;
+
+        // used when body.on_element is set
+        json::stream_parser& element;
+        std::optional<json::array> others;
+        std::size_t depth = 0;
+        bool in_string = false;
+        bool escaped = false;
+        bool in_element = false;
+        bool root_done = false;
+        bool whole = false;
     };
 };
 
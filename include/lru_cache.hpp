@@ -0,0 +1,129 @@
+/**
+ * @file lru_cache.hpp
+ * @brief Thread-safe LRU cache of shared immutable objects, bounded in bytes
+ * @author Giuseppe Roberti <inbox> <at> <roberti> <dot> <dev>
+ */
+#ifndef LRU_CACHE_HPP
+#define LRU_CACHE_HPP
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace dict {
+
+struct lru_stats {
+    std::uint64_t hits = 0;
+    std::uint64_t misses = 0;
+    std::uint64_t evictions = 0;
+    std::size_t entries = 0;
+    std::size_t bytes = 0;
+    std::size_t budget = 0;
+};
+
+template<class T>
+class lru_cache {
+public:
+    using value_type = std::shared_ptr<const T>;
+
+private:
+    struct node {
+        std::string key;
+        value_type value;
+        std::size_t bytes;
+    };
+
+    mutable std::mutex m_mutex;
+    std::list<node> m_nodes;
+    std::unordered_map<std::string, typename std::list<node>::iterator> m_index;
+    std::size_t m_budget;
+    std::size_t m_bytes = 0;
+    std::uint64_t m_hits = 0, m_misses = 0, m_evictions = 0;
+
+public:
+    explicit lru_cache (std::size_t budget):
+        m_budget(budget)
+    {}
+
+    /// The process-wide instance.
+    static lru_cache& global () {
+        static lru_cache cache(32 << 20);
+        return cache;
+    }
+
+    value_type get (std::string const& key) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        auto it = m_index.find(key);
+        if (it == m_index.end()) {
+            ++m_misses;
+            return nullptr;
+        }
+
+        ++m_hits;
+        m_nodes.splice(m_nodes.begin(), m_nodes, it->second);
+        return it->second->value;
+    }
+
+    /// Store a value that takes `bytes` of memory, evicting the least
+    /// recently used ones to stay within the budget.
+    void put (std::string const& key, value_type value, std::size_t bytes) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        erase(key);
+
+        if (bytes > m_budget)
+            return;
+
+        m_nodes.push_front({key, std::move(value), bytes});
+        m_index.emplace(key, m_nodes.begin());
+        m_bytes += bytes;
+
+        shrink();
+    }
+
+    void set_budget (std::size_t budget) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_budget = budget;
+        shrink();
+    }
+
+    void clear () {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_index.clear();
+        m_nodes.clear();
+        m_bytes = 0;
+    }
+
+    lru_stats stats () const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return {m_hits, m_misses, m_evictions, m_nodes.size(), m_bytes, m_budget};
+    }
+
+private:
+    void erase (std::string const& key) {
+        auto it = m_index.find(key);
+        if (it == m_index.end())
+            return;
+        m_bytes -= it->second->bytes;
+        m_nodes.erase(it->second);
+        m_index.erase(it);
+    }
+
+    void shrink () {
+        while (m_bytes > m_budget && !m_nodes.empty()) {
+            auto& last = m_nodes.back();
+            m_bytes -= last.bytes;
+            m_index.erase(last.key);
+            m_nodes.pop_back();
+            ++m_evictions;
+        }
+    }
+};
+
+} // namespace dict
+
+#endif // LRU_CACHE_HPP
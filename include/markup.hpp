@@ -0,0 +1,266 @@
+/**
+ * @file markup.hpp
+ * @brief Single pass renderer of Merriam-Webster tokens to Pango markup
+ * @author Giuseppe Roberti <inbox> <at> <roberti> <dot> <dev>
+ */
+#ifndef MARKUP_HPP
+#define MARKUP_HPP
+
+#include "dict.hpp"
+
+#include <array>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <string_view>
+
+namespace app {
+
+namespace markup {
+
+enum class kind {
+    open,       // {it} ... {/it}
+    literal,    // {bc}, {ldquo}, ...
+    link,       // {a_link|text}, {sx|text|id|n}, ...
+    skip        // {ds|...}, ...
+};
+
+struct token {
+    std::string_view name;
+    kind type;
+    std::string_view before;
+    std::string_view after;
+    // the same, for plain text
+    std::string_view text_before;
+    std::string_view text_after;
+};
+
+// see https://dictionaryapi.com/products/json#sec-2.tokens
+inline constexpr std::array<token, 26> tokens = {{
+    {"b",       kind::open,    "<b>", "</b>", "", ""},
+    {"it",      kind::open,    "<i>", "</i>", "", ""},
+    {"inf",     kind::open,    "<sub>", "</sub>", "", ""},
+    {"sup",     kind::open,    "<sup>", "</sup>", "", ""},
+    {"sc",      kind::open,    "<span variant=\"smallcaps\">", "</span>", "", ""},
+    {"wi",      kind::open,    "<i>", "</i>", "", ""},
+    {"qword",   kind::open,    "<i>", "</i>", "", ""},
+    {"phrase",  kind::open,    "<b><i>", "</i></b>", "", ""},
+    {"parahw",  kind::open,    "<b><span variant=\"smallcaps\">", "</span></b>", "", ""},
+    {"gloss",   kind::open,    "[", "]", "[", "]"},
+    {"dx",      kind::open,    " — ", "", " — ", ""},
+    {"dx_def",  kind::open,    "(", ")", "(", ")"},
+    {"dx_ety",  kind::open,    " — ", "", " — ", ""},
+    {"ma",      kind::open,    " — more at ", "", " — more at ", ""},
+    {"bc",      kind::literal, "<b><tt> : </tt></b>", "", " : ", ""},
+    {"ldquo",   kind::literal, "“", "", "“", ""},
+    {"rdquo",   kind::literal, "”", "", "”", ""},
+    {"p_br",    kind::literal, "\n", "", "\n", ""},
+    {"a_link",  kind::link,    "<i>", "</i>", "", ""},
+    {"d_link",  kind::link,    "<i>", "</i>", "", ""},
+    {"i_link",  kind::link,    "<i>", "</i>", "", ""},
+    {"et_link", kind::link,    "<span variant=\"smallcaps\">", "</span>", "", ""},
+    {"mat",     kind::link,    "<span variant=\"smallcaps\">", "</span>", "", ""},
+    {"sx",      kind::link,    "<span variant=\"smallcaps\">", "</span>", "", ""},
+    {"dxt",     kind::link,    "<span variant=\"smallcaps\">", "</span>", "", ""},
+    {"ds",      kind::skip,    "", "", "", ""},
+}};
+
+inline token const* find (std::string_view name) {
+    for (auto& t : tokens)
+        if (t.name == name)
+            return &t;
+    return nullptr;
+}
+
+inline void escape (std::string& out, std::string_view text) {
+    std::size_t i = 0;
+    for (auto j = text.find_first_of("&<>"); j != std::string_view::npos;
+         i = j + 1, j = text.find_first_of("&<>", i)) {
+        out.append(text.data() + i, j - i);
+        switch (text[j]) {
+        case '&': out += "&amp;"; break;
+        case '<': out += "&lt;"; break;
+        case '>': out += "&gt;"; break;
+        }
+    }
+    out.append(text.data() + i, text.size() - i);
+}
+
+/// Output formats of render_as.
+enum class format {
+    pango,
+    text
+};
+
+/// Append to out a text with Merriam-Webster tokens, rendered in a single
+/// pass: unknown tokens are dropped, closing tokens that do not match are
+/// ignored and open ones are closed at the end.
+template<format Format>
+void render_as (std::string& out, std::string_view text) {
+    constexpr bool pango = Format == format::pango;
+    constexpr std::size_t max_depth = 16;
+
+    auto copy = [&out](std::string_view s) {
+        if (pango)
+            escape(out, s);
+        else
+            out.append(s.data(), s.size());
+    };
+    std::array<token const*, max_depth> open;
+    std::size_t depth = 0;
+
+    std::size_t i = 0;
+    while (i < text.size()) {
+        auto brace = text.find('{', i);
+        auto close = brace == std::string_view::npos
+                ? brace : text.find('}', brace);
+
+        if (close == std::string_view::npos) {
+            copy(text.substr(i));
+            break;
+        }
+
+        copy(text.substr(i, brace - i));
+        i = close + 1;
+
+        auto body = text.substr(brace + 1, close - brace - 1);
+        auto bar = body.find('|');
+        auto name = body.substr(0, bar);
+
+        if (!name.empty() && name.front() == '/') {
+            auto t = find(name.substr(1));
+            if (t && depth > 0 && open[depth - 1] == t) {
+                out += pango ? t->after : t->text_after;
+                --depth;
+            }
+            continue;
+        }
+
+        auto t = find(name);
+        if (!t)
+            continue;
+
+        switch (t->type) {
+        case kind::open:
+            if (depth < max_depth) {
+                out += pango ? t->before : t->text_before;
+                open[depth++] = t;
+            }
+            break;
+        case kind::literal:
+            out += pango ? t->before : t->text_before;
+            break;
+        case kind::link: {
+            // the text to show is the first field
+            auto field = bar == std::string_view::npos
+                    ? std::string_view() : body.substr(bar + 1);
+            field = field.substr(0, field.find('|'));
+            out += pango ? t->before : t->text_before;
+            copy(field.substr(0, field.find(':')));
+            out += pango ? t->after : t->text_after;
+            break;
+        }
+        case kind::skip:
+            break;
+        }
+    }
+
+    while (depth > 0) {
+        auto t = open[--depth];
+        out += pango ? t->after : t->text_after;
+    }
+}
+
+/// Append to out the Pango markup for a text with Merriam-Webster tokens.
+inline void render (std::string& out, std::string_view text) {
+    render_as<format::pango>(out, text);
+}
+
+/// Append to out a text with Merriam-Webster tokens, as plain text.
+inline void render_text (std::string& out, std::string_view text) {
+    render_as<format::text>(out, text);
+}
+
+/// Append the markup of the header of an entry: its headword, in bold, and
+/// its functional label (eg: noun), in italic.
+template<class Entry>
+void render_entry (std::string& out, Entry const& e) {
+    out += "<b>";
+    escape(out, e.get_headword());
+    out += "</b>";
+
+    auto fl = e.get_fl();
+    if (!fl.empty()) {
+        out += "  <i>";
+        escape(out, fl);
+        out += "</i>";
+    }
+}
+
+/// Append the markup of a whole sense: its number, the text and the type.
+template<class Sense>
+void render_sense (std::string& out, Sense const& s) {
+    constexpr std::size_t sn_width = 8;
+
+    out += "<b><tt>";
+    auto sn = s.get_sn().value_or(std::string_view());
+    if (sn.size() < sn_width)
+        out.append(sn_width - sn.size(), ' ');
+    escape(out, sn);
+    out += "</tt></b>";
+
+    render(out, s.get_text());
+
+    out += " (";
+    out += s.get_type();
+    out += ")";
+}
+
+/// Append the plain text of a whole sense, laid out like render_sense.
+template<class Sense>
+void render_sense_text (std::string& out, Sense const& s) {
+    constexpr std::size_t sn_width = 8;
+
+    auto sn = s.get_sn().value_or(std::string_view());
+    if (sn.size() < sn_width)
+        out.append(sn_width - sn.size(), ' ');
+    out.append(sn.data(), sn.size());
+
+    render_text(out, s.get_text());
+
+    out += " (";
+    out += s.get_type();
+    out += ")";
+}
+
+/// A buffer reused by every render on the same thread.
+inline std::string& buffer () {
+    thread_local std::string buf;
+    buf.clear();
+    return buf;
+}
+
+} // namespace markup
+
+inline std::ostream& operator<< (std::ostream& out, dict::sense const& s) {
+    auto& buf = markup::buffer();
+    markup::render_sense(buf, s);
+    return out.write(buf.data(), buf.size());
+}
+
+inline std::ostream& operator<< (std::ostream& out, dict::entry const& e) {
+    for (auto& sense : e.senses())
+        out << sense << "\n";
+    return out;
+}
+
+inline std::ostream& operator<< (std::ostream& out, dict::result const& r) {
+    for (auto& entry : r.entries())
+        out << "\n" << entry;
+
+    return out;
+}
+
+} // namespace app
+
+#endif // MARKUP_HPP
@@ -0,0 +1,251 @@
+/**
+ * @file metrics.hpp
+ * @brief Lock-free latency histograms for the phases of a lookup
+ * @author Giuseppe Roberti <inbox> <at> <roberti> <dot> <dev>
+ */
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include "trace.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <ostream>
+#include <string>
+
+namespace dict {
+
+/// Log-linear histogram of durations, like HdrHistogram: values are kept in
+/// microseconds, with 16 buckets for every power of two, so that what is
+/// reported is within 1/16 of what was recorded. Recording is a handful of
+/// relaxed atomic operations, from any thread.
+class histogram {
+public:
+    using duration = std::chrono::microseconds;
+
+    static constexpr unsigned sub_bits = 4;
+    static constexpr unsigned max_bits = 36;    // about 19 hours
+
+private:
+    static constexpr std::uint64_t sub_count = std::uint64_t(1) << sub_bits;
+    static constexpr std::uint64_t max_value = (std::uint64_t(1) << max_bits) - 1;
+    static constexpr std::size_t bucket_count = (max_bits - sub_bits + 1) * sub_count;
+
+    std::array<std::atomic<std::uint64_t>, bucket_count> m_buckets{};
+    std::atomic<std::uint64_t> m_count{0}, m_sum{0}, m_max{0};
+
+public:
+    void record (duration d) {
+        auto v = static_cast<std::uint64_t>(std::max<duration::rep>(0, d.count()));
+        if (v > max_value)
+            v = max_value;
+
+        m_buckets[index(v)].fetch_add(1, std::memory_order_relaxed);
+        m_count.fetch_add(1, std::memory_order_relaxed);
+        m_sum.fetch_add(v, std::memory_order_relaxed);
+
+        auto max = m_max.load(std::memory_order_relaxed);
+        while (v > max && !m_max.compare_exchange_weak(max, v, std::memory_order_relaxed));
+    }
+
+    std::uint64_t count () const {
+        return m_count.load(std::memory_order_relaxed);
+    }
+
+    duration sum () const {
+        return duration(m_sum.load(std::memory_order_relaxed));
+    }
+
+    duration max () const {
+        return duration(m_max.load(std::memory_order_relaxed));
+    }
+
+    /// The smallest value such that a fraction q of the recorded ones are
+    /// not greater than it (0 if nothing was recorded).
+    duration percentile (double q) const {
+        std::uint64_t total = 0;
+        for (auto& b : m_buckets)
+            total += b.load(std::memory_order_relaxed);
+        if (total == 0)
+            return duration(0);
+
+        auto rank = static_cast<std::uint64_t>(q * total + 0.5);
+        rank = std::min(std::max<std::uint64_t>(rank, 1), total);
+
+        std::uint64_t seen = 0;
+        for (std::size_t i = 0; i < bucket_count; ++i) {
+            seen += m_buckets[i].load(std::memory_order_relaxed);
+            if (seen >= rank)
+                return duration(std::min<std::uint64_t>(
+                        highest(i), m_max.load(std::memory_order_relaxed)));
+        }
+        return max();
+    }
+
+private:
+    static std::size_t index (std::uint64_t v) {
+        // the first 2 * sub_count values have a bucket each
+        if (v < 2 * sub_count)
+            return v;
+        unsigned msb = 63 - __builtin_clzll(v);
+        return (msb - sub_bits) * sub_count + (v >> (msb - sub_bits));
+    }
+
+    static std::uint64_t lowest (std::size_t i) {
+        if (i < 2 * sub_count)
+            return i;
+        unsigned msb = i / sub_count + sub_bits - 1;
+        return (i % sub_count + sub_count) << (msb - sub_bits);
+    }
+
+    static std::uint64_t highest (std::size_t i) {
+        return i + 1 < bucket_count ? lowest(i + 1) - 1 : max_value;
+    }
+};
+
+/// The phases of a lookup, from the name resolution to the result on screen.
+enum class phase {
+    dns,        ///< endpoints of the service (cached ones take no time)
+    connect,    ///< TCP connection, only for new connections
+    tls,        ///< TLS handshake, only for new connections
+    ttfb,       ///< from sending the request to the response header
+    body,       ///< receiving and parsing the response body
+    build,      ///< building the result out of the parsed JSON
+    render,     ///< turning the result into rows of the view
+    lookup,     ///< the whole lookup, caches included
+    count
+};
+
+inline const char* phase_name (phase p) {
+    static constexpr const char* names[] = {
+        "dns", "connect", "tls", "ttfb", "body", "build", "render", "lookup"
+    };
+    return names[static_cast<std::size_t>(p)];
+}
+
+class metrics {
+private:
+    std::array<histogram, static_cast<std::size_t>(phase::count)> m_phases;
+    std::atomic<std::uint64_t> m_bytes_sent{0}, m_bytes_received{0};
+
+public:
+    /// The process-wide instance.
+    static metrics& global () {
+        static metrics m;
+        return m;
+    }
+
+    void record (phase p, histogram::duration d) {
+        m_phases[static_cast<std::size_t>(p)].record(d);
+    }
+
+    histogram const& operator[] (phase p) const {
+        return m_phases[static_cast<std::size_t>(p)];
+    }
+
+    void sent (std::uint64_t bytes) {
+        m_bytes_sent.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    void received (std::uint64_t bytes) {
+        m_bytes_received.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    std::uint64_t bytes_sent () const {
+        return m_bytes_sent.load(std::memory_order_relaxed);
+    }
+
+    std::uint64_t bytes_received () const {
+        return m_bytes_received.load(std::memory_order_relaxed);
+    }
+
+    /// Every phase as a summary, in the Prometheus text format.
+    void write_prometheus (std::ostream& os) const {
+        static constexpr double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+        os << "# HELP dict_phase_seconds Time spent in each phase of a lookup.\n"
+              "# TYPE dict_phase_seconds summary\n";
+        for (std::size_t i = 0; i < m_phases.size(); ++i) {
+            auto& h = m_phases[i];
+            auto name = phase_name(static_cast<phase>(i));
+            for (auto q : quantiles)
+                os << "dict_phase_seconds{phase=\"" << name << "\",quantile=\""
+                   << q << "\"} " << seconds(h.percentile(q)) << "\n";
+            os << "dict_phase_seconds_sum{phase=\"" << name << "\"} "
+               << seconds(h.sum()) << "\n";
+            os << "dict_phase_seconds_count{phase=\"" << name << "\"} "
+               << h.count() << "\n";
+        }
+
+        os << "# HELP dict_bytes_sent_total Bytes of the requests sent.\n"
+              "# TYPE dict_bytes_sent_total counter\n"
+              "dict_bytes_sent_total " << bytes_sent() << "\n";
+        os << "# HELP dict_bytes_received_total Bytes of the responses received.\n"
+              "# TYPE dict_bytes_received_total counter\n"
+              "dict_bytes_received_total " << bytes_received() << "\n";
+    }
+
+    /// One line for humans, eg: "lookup p50 84.2 ms p99 310.0 ms, ...".
+    std::string summary () const {
+        std::string out;
+        char buf[96];
+
+        for (auto p : {phase::lookup, phase::ttfb, phase::render}) {
+            auto& h = (*this)[p];
+            if (h.count() == 0)
+                continue;
+            std::snprintf(buf, sizeof buf, "%s%s p50 %.1f ms p99 %.1f ms",
+                          out.empty() ? "" : ", ", phase_name(p),
+                          millis(h.percentile(0.5)), millis(h.percentile(0.99)));
+            out += buf;
+        }
+
+        std::snprintf(buf, sizeof buf, "%s%.1f kB received",
+                      out.empty() ? "" : ", ", bytes_received() / 1024.0);
+        return out + buf;
+    }
+
+private:
+    static double seconds (histogram::duration d) {
+        return std::chrono::duration<double>(d).count();
+    }
+
+    static double millis (histogram::duration d) {
+        return std::chrono::duration<double, std::milli>(d).count();
+    }
+};
+
+/// Measures the time elapsed since it was started, a phase at a time.
+class stopwatch {
+public:
+    using clock = std::chrono::steady_clock;
+
+private:
+    clock::time_point m_start = clock::now();
+
+public:
+    void restart () {
+        m_start = clock::now();
+    }
+
+    histogram::duration elapsed () const {
+        return std::chrono::duration_cast<histogram::duration>(clock::now() - m_start);
+    }
+
+    /// Record the time elapsed as phase p, also as a span when tracing,
+    /// then start measuring the next one.
+    void lap (phase p, metrics& m = metrics::global()) {
+        auto now = clock::now();
+        m.record(p, std::chrono::duration_cast<histogram::duration>(now - m_start));
+        trace::span(phase_name(p), m_start, now);
+        m_start = now;
+    }
+};
+
+} // namespace dict
+
+#endif // METRICS_HPP
@@ -0,0 +1,361 @@
+/**
+ * @file prefix_index.hpp
+ * @brief In-process trie of known terms, used to complete a prefix locally
+ * @author Giuseppe Roberti <inbox> <at> <roberti> <dot> <dev>
+ */
+#ifndef PREFIX_INDEX_HPP
+#define PREFIX_INDEX_HPP
+
+#include <boost/log/trivial.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <istream>
+#include <limits>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace dict {
+
+/// Nodes live in a single vector and refer to each other by index: a node
+/// has a link to its first child and to its next sibling, and siblings are
+/// sorted by label, so completions come out in lexicographic order.
+/// After compact() the children of every node are also adjacent in memory.
+/// Thread-safe: lookups only take a shared lock.
+class prefix_index {
+private:
+    using index_type = std::uint32_t;
+
+    static constexpr index_type none = std::numeric_limits<index_type>::max();
+
+    struct node {
+        index_type first_child = none;
+        index_type next_sibling = none;
+        unsigned char label = 0;
+        bool terminal = false;
+        // lengths of the shortest and the longest term below, past the
+        // node (up to 255)
+        unsigned char shortest = 255;
+        unsigned char longest = 0;
+    };
+
+    mutable std::shared_mutex m_mutex;
+    std::vector<node> m_nodes;
+    std::size_t m_terms = 0;
+
+public:
+    prefix_index ():
+        m_nodes(1)
+    {}
+
+    std::size_t size () const {
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        return m_terms;
+    }
+
+    /// Add a term, returning false if it was already there.
+    bool insert (std::string_view term) {
+        if (term.empty())
+            return false;
+
+        std::unique_lock<std::shared_mutex> lock(m_mutex);
+        return insert_locked(term);
+    }
+
+    /// Add a term per line of the stream, then compact the index.
+    std::size_t load (std::istream& in) {
+        std::unique_lock<std::shared_mutex> lock(m_mutex);
+
+        std::size_t added = 0;
+        std::string line;
+        while (std::getline(in, line)) {
+            if (!line.empty() && line.back() == '\r')
+                line.pop_back();
+            if (!line.empty() && insert_locked(line))
+                ++added;
+        }
+
+        compact_locked();
+        return added;
+    }
+
+    std::size_t load_file (std::string const& path) {
+        std::ifstream in(path);
+        if (!in) {
+            BOOST_LOG_TRIVIAL(error)
+                    << "Unable to open word list " << path;
+            return 0;
+        }
+
+        auto added = load(in);
+        BOOST_LOG_TRIVIAL(trace)
+                << "Loaded " << added << " terms from " << path;
+        return added;
+    }
+
+    bool contains (std::string_view term) const {
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+
+        index_type n = 0;
+        for (unsigned char c : term) {
+            n = find_child(n, c);
+            if (n == none)
+                return false;
+        }
+        return m_nodes[n].terminal;
+    }
+
+    /// At most max terms starting with prefix, in lexicographic order.
+    std::vector<std::string> complete (std::string_view prefix,
+                                       std::size_t max) const {
+        std::vector<std::string> terms;
+        if (max == 0)
+            return terms;
+
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+
+        index_type n = 0;
+        for (unsigned char c : prefix) {
+            n = find_child(n, c);
+            if (n == none)
+                return terms;
+        }
+
+        // depth first, the stack holds the nodes still to visit and the
+        // length of the term at their parent
+        std::string term(prefix);
+        std::vector<std::pair<index_type, std::size_t>> stack;
+
+        if (m_nodes[n].terminal)
+            terms.push_back(term);
+        if (m_nodes[n].first_child != none)
+            stack.emplace_back(m_nodes[n].first_child, term.size());
+
+        while (!stack.empty() && terms.size() < max) {
+            auto [i, length] = stack.back();
+            stack.pop_back();
+
+            auto const& child = m_nodes[i];
+            if (child.next_sibling != none)
+                stack.emplace_back(child.next_sibling, length);
+
+            term.resize(length);
+            term.push_back(static_cast<char>(child.label));
+            if (child.terminal)
+                terms.push_back(term);
+            if (child.first_child != none)
+                stack.emplace_back(child.first_child, term.size());
+        }
+
+        return terms;
+    }
+
+    /// Call f(term, distance) with the terms within radius edits of term,
+    /// counting insertions, deletions, substitutions and transpositions of
+    /// adjacent characters; term must be 1 to 64 bytes long. Only the terms
+    /// that have a prefix within (radius + 1) / 2 edits of the first split
+    /// characters of term are sure to be found (all of them with split 0).
+    ///
+    /// The trie is walked depth first, with the column of the distance
+    /// matrix of every prefix kept as bit vectors (the algorithm of Myers,
+    /// with the transpositions of Hyyrö), so a node costs a few word
+    /// operations; a subtree is skipped as soon as no term in it can be
+    /// that close.
+    template<class F>
+    void within (std::string_view term, std::size_t radius, std::size_t split,
+                 F&& f) const {
+        const std::size_t m = term.size();
+        const std::size_t half = (radius + 1) / 2;
+        if (m == 0 || m > 64)
+            return;
+
+        std::uint64_t peq[256] = {};
+        for (std::size_t i = 0; i < m; ++i)
+            peq[static_cast<unsigned char>(term[i])] |= std::uint64_t(1) << i;
+        const std::uint64_t last = std::uint64_t(1) << (m - 1);
+
+        // the column at depth j, for the prefix word[0, j)
+        struct column {
+            std::uint64_t vp = ~std::uint64_t(0);
+            std::uint64_t vn = 0;
+            std::uint64_t d0 = 0;
+            std::uint64_t eq = 0;
+            std::size_t score = 0;      // distance from term
+            std::size_t top = 0;        // at the first row of the band
+            bool split = false;         // a prefix was close to term[0, split)
+        };
+        const std::size_t depth_max = m + radius;
+        std::vector<column> columns(depth_max + 1);
+        std::vector<index_type> current(depth_max + 1, none);
+        std::string word(depth_max, '\0');
+        columns[0].score = m;
+        columns[0].split = split == 0;
+
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+
+        std::size_t j = 1;
+        current[1] = m_nodes[0].first_child;
+        while (j > 0) {
+            auto i = current[j];
+            if (i == none) {
+                if (--j > 0)
+                    current[j] = m_nodes[current[j]].next_sibling;
+                continue;
+            }
+
+            auto const& n = m_nodes[i];
+            auto const& prev = columns[j - 1];
+            auto& c = columns[j];
+            word[j - 1] = static_cast<char>(n.label);
+
+            c.eq = peq[n.label];
+            auto tc = ((~prev.d0 & c.eq) << 1) & prev.eq;
+            c.d0 = (((c.eq & prev.vp) + prev.vp) ^ prev.vp) | c.eq | prev.vn | tc;
+            auto hp = prev.vn | ~(c.d0 | prev.vp);
+            auto hn = prev.vp & c.d0;
+            c.score = prev.score + ((hp & last) != 0) - ((hn & last) != 0);
+
+            // the band |row - j| <= radius starts one row down the diagonal
+            if (j > radius) {
+                auto bit = j - radius - 1;
+                c.top = prev.top + ((prev.vp >> bit) & 1) - ((prev.vn >> bit) & 1)
+                                 + ((hp >> bit) & 1) - ((hn >> bit) & 1);
+            } else {
+                c.top = j;
+            }
+
+            hp = (hp << 1) | 1;
+            hn <<= 1;
+            c.vp = hn | ~(c.d0 | hp);
+            c.vn = hp & c.d0;
+
+            if (n.terminal && c.score <= radius)
+                f(std::string_view(word.data(), j), c.score);
+
+            // a term below is at least as far as a row of the column, plus
+            // the difference between the rest of the row and the rest of
+            // the term; the rows out of the band are farther than radius
+            bool near = false, near_split = false;
+            c.split = prev.split;
+            if (j < depth_max && n.first_child != none) {
+                auto row = j > radius ? j - radius : 0;
+                auto high = std::min(m, j + radius);
+                for (auto d = c.top;; ++row) {
+                    auto rest = m - row;
+                    auto gap = rest < n.shortest ? n.shortest - rest
+                             : rest > n.longest ? rest - n.longest : 0;
+                    near = near || d + gap <= radius;
+                    near_split = near_split || (row <= split && d <= half);
+                    c.split = c.split || (row == split && d <= half);
+                    if (row == high)
+                        break;
+                    d = d + ((c.vp >> row) & 1) - ((c.vn >> row) & 1);
+                }
+            }
+
+            if (near && (c.split || near_split))
+                current[++j] = n.first_child;
+            else
+                current[j] = n.next_sibling;
+        }
+    }
+
+    /// Lay out the nodes breadth first, so that siblings are adjacent.
+    void compact () {
+        std::unique_lock<std::shared_mutex> lock(m_mutex);
+        compact_locked();
+    }
+
+private:
+    index_type find_child (index_type parent, unsigned char label) const {
+        for (auto i = m_nodes[parent].first_child; i != none;
+             i = m_nodes[i].next_sibling) {
+            if (m_nodes[i].label == label)
+                return i;
+            if (m_nodes[i].label > label)
+                break;
+        }
+        return none;
+    }
+
+    bool insert_locked (std::string_view term) {
+        index_type n = 0;
+        std::size_t rest = term.size();
+
+        for (unsigned char c : term) {
+            // find the child, or the place where to link a new one
+            index_type prev = none;
+            index_type i = m_nodes[n].first_child;
+            while (i != none && m_nodes[i].label < c) {
+                prev = i;
+                i = m_nodes[i].next_sibling;
+            }
+
+            if (i == none || m_nodes[i].label != c) {
+                node child;
+                child.label = c;
+                child.next_sibling = i;
+                auto const added = static_cast<index_type>(m_nodes.size());
+                m_nodes.push_back(child);
+                if (prev == none)
+                    m_nodes[n].first_child = added;
+                else
+                    m_nodes[prev].next_sibling = added;
+                i = added;
+            }
+
+            n = i;
+
+            auto& added = m_nodes[n];
+            auto length = static_cast<unsigned char>(std::min<std::size_t>(--rest, 255));
+            added.shortest = std::min(added.shortest, length);
+            added.longest = std::max(added.longest, length);
+        }
+
+        if (m_nodes[n].terminal)
+            return false;
+
+        m_nodes[n].terminal = true;
+        ++m_terms;
+        return true;
+    }
+
+    void compact_locked () {
+        std::vector<node> nodes;
+        nodes.reserve(m_nodes.size());
+        nodes.push_back(m_nodes[0]);
+
+        // nodes[j] is the copy of m_nodes[from[j]]
+        std::vector<index_type> from;
+        from.reserve(m_nodes.size());
+        from.push_back(0);
+
+        for (std::size_t j = 0; j < nodes.size(); ++j) {
+            auto first = m_nodes[from[j]].first_child;
+            if (first == none)
+                continue;
+
+            nodes[j].first_child = static_cast<index_type>(nodes.size());
+            for (auto i = first; i != none; i = m_nodes[i].next_sibling) {
+                node child = m_nodes[i];
+                child.first_child = none;
+                child.next_sibling = m_nodes[i].next_sibling == none
+                        ? none : static_cast<index_type>(nodes.size() + 1);
+                nodes.push_back(child);
+                from.push_back(i);
+            }
+        }
+
+        m_nodes = std::move(nodes);
+        m_nodes.shrink_to_fit();
+    }
+};
+
+} // namespace dict
+
+#endif // PREFIX_INDEX_HPP
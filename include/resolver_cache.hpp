@@ -0,0 +1,129 @@
+/**
+ * @file resolver_cache.hpp
+ * @brief TTL-aware cache of resolved endpoints, refreshed in background
+ * @author Giuseppe Roberti <inbox> <at> <roberti> <dot> <dev>
+ */
+#ifndef RESOLVER_CACHE_HPP
+#define RESOLVER_CACHE_HPP
+
+#include <boost/asio.hpp>
+#include <boost/log/trivial.hpp>
+
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace dict {
+
+namespace system = boost::system;
+namespace asio = boost::asio;
+
+namespace ip = asio::ip;
+
+using tcp = ip::tcp;
+
+/// All member functions must be called from the thread running the io_context.
+class resolver_cache {
+public:
+    using clock = std::chrono::steady_clock;
+    using results_type = ip::basic_resolver_results<tcp>;
+    using handler_type = std::function<void(system::error_code, results_type)>;
+
+private:
+    tcp::resolver m_resolver;
+    asio::steady_timer m_timer;
+    const std::string m_host, m_port;
+    const clock::duration m_ttl, m_retry;
+
+    results_type m_results;
+    clock::time_point m_expiry;
+    std::vector<handler_type> m_waiting;
+    bool m_resolving = false;
+
+public:
+    resolver_cache (asio::io_context& io_context,
+                    std::string host, std::string port,
+                    clock::duration ttl, clock::duration retry):
+        m_resolver(io_context)
+      , m_timer(io_context)
+      , m_host(std::move(host)), m_port(std::move(port))
+      , m_ttl(ttl), m_retry(retry)
+    {}
+
+    /// Start resolving in background, so the first request will not wait.
+    void start () {
+        asio::post(m_resolver.get_executor(), [this]{ resolve(); });
+    }
+
+    /// Call the handler with the cached endpoints; it only waits if
+    /// nothing was ever resolved.
+    void async_endpoints (handler_type handler) {
+        if (!m_results.empty()) {
+            if (clock::now() > m_expiry)
+                BOOST_LOG_TRIVIAL(trace)
+                        << "Using stale endpoints for " << m_host;
+            handler({}, m_results);
+            return;
+        }
+
+        m_waiting.push_back(std::move(handler));
+        resolve();
+    }
+
+private:
+    void resolve () {
+        if (m_resolving)
+            return;
+        m_resolving = true;
+
+        m_timer.cancel();
+        m_resolver.async_resolve(m_host, m_port,
+                [this](system::error_code ec, results_type results) {
+            on_resolve(ec, std::move(results));
+        });
+    }
+
+    void on_resolve (system::error_code ec, results_type results) {
+        m_resolving = false;
+
+        if (ec == asio::error::operation_aborted)
+            return;
+
+        clock::duration next;
+
+        if (!ec && !results.empty()) {
+            BOOST_LOG_TRIVIAL(trace)
+                    << "Host:service " << m_host << ":" << m_port
+                    << " resolved to " << results.size() << " endpoints";
+            m_results = std::move(results);
+            m_expiry = clock::now() + m_ttl;
+
+            // refresh a bit before the cached endpoints expire
+            next = m_ttl - m_ttl / 5;
+        } else {
+            // keep the last known good endpoints and retry soon
+            BOOST_LOG_TRIVIAL(error)
+                    << "Unable to resolve " << m_host << ": "
+                    << ec.message();
+            if (!ec)
+                ec = asio::error::host_not_found;
+            next = m_retry;
+        }
+
+        auto waiting = std::move(m_waiting);
+        m_waiting.clear();
+        for (auto& handler : waiting)
+            handler(m_results.empty() ? ec : system::error_code{}, m_results);
+
+        m_timer.expires_after(next);
+        m_timer.async_wait([this](system::error_code ec) {
+            if (!ec)
+                resolve();
+        });
+    }
+};
+
+} // namespace dict
+
+#endif // RESOLVER_CACHE_HPP
@@ -0,0 +1,511 @@
+/**
+ * @file response_cache.hpp
+ * @brief Persistent, append-only, memory-mapped cache of raw JSON responses
+ * @author Giuseppe Roberti <inbox> <at> <roberti> <dot> <dev>
+ */
+#ifndef RESPONSE_CACHE_HPP
+#define RESPONSE_CACHE_HPP
+
+#include <boost/log/trivial.hpp>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace dict {
+
+/// The file starts with a magic and is followed by records made of a
+/// fixed size header, the key and the body. A record is only ever appended,
+/// so the last one stored for a key wins; the index is rebuilt on open.
+///
+/// Several processes can share the file: records are appended holding an
+/// exclusive flock(), at the end of the file as it is then, and the ones
+/// appended by the other processes are indexed first. When the file grows
+/// past its maximum size, or is mostly made of records stored again since,
+/// it is rewritten with only the last record of each key (the most recent
+/// ones, as many as fit in three quarters of the maximum size) and renamed
+/// over the old one; the other processes reopen it once they notice.
+class response_cache {
+public:
+    using clock = std::chrono::system_clock;
+
+private:
+    struct record_header {
+        std::uint32_t checksum;
+        std::uint32_t key_size;
+        std::uint32_t body_size;
+        std::uint32_t reserved;
+        std::int64_t stored_at;
+    };
+
+    struct index_entry {
+        std::uint64_t offset;
+        std::uint32_t size;
+        std::int64_t stored_at;
+    };
+
+    static constexpr char magic[8] = {'D', 'I', 'C', 'T', 'R', 'C', '0', '1'};
+
+    // not worth rewriting for the records stored again, below this size
+    static constexpr std::uint64_t min_compact_size = 1 << 20;
+
+    /// Holds the flock() of the file, see lock_file.
+    class file_lock {
+    private:
+        response_cache& m_cache;
+        bool m_locked;
+
+    public:
+        explicit file_lock (response_cache& cache):
+            m_cache(cache), m_locked(cache.lock_file())
+        {}
+
+        file_lock (file_lock const&) = delete;
+        file_lock& operator= (file_lock const&) = delete;
+
+        ~file_lock () {
+            if (m_locked && m_cache.m_fd >= 0)
+                ::flock(m_cache.m_fd, LOCK_UN);
+        }
+
+        explicit operator bool () const {
+            return m_locked;
+        }
+    };
+
+    const std::string m_path;
+    const std::uint64_t m_max_size;
+
+    mutable std::mutex m_mutex;
+    int m_fd = -1;
+    const char* m_map = nullptr;
+    std::size_t m_map_size = 0;
+    // the end of the last record indexed
+    std::uint64_t m_file_size = 0;
+    std::unordered_map<std::string, index_entry> m_index;
+
+public:
+    static constexpr std::uint64_t default_max_size = 64 << 20;
+
+    explicit response_cache (std::string path,
+                             std::uint64_t max_size = default_max_size):
+        m_path(std::move(path))
+      , m_max_size(std::max<std::uint64_t>(max_size, sizeof magic))
+    {
+        if (!open())
+            return;
+
+        file_lock lock(*this);
+        if (!lock || !refresh(true)) {
+            BOOST_LOG_TRIVIAL(error)
+                    << "Invalid response cache " << m_path;
+            close();
+            return;
+        }
+
+        if (needs_compaction())
+            compact();
+
+        BOOST_LOG_TRIVIAL(trace)
+                << "Response cache " << m_path << " has "
+                << m_index.size() << " terms";
+    }
+
+    response_cache (response_cache const&) = delete;
+    response_cache& operator= (response_cache const&) = delete;
+
+    ~response_cache () {
+        close();
+    }
+
+    bool is_open () const {
+        return m_fd >= 0;
+    }
+
+    std::size_t size () const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_index.size();
+    }
+
+    /// Every key stored, in no particular order.
+    std::vector<std::string> keys () const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::vector<std::string> keys;
+        keys.reserve(m_index.size());
+        for (auto& [key, entry] : m_index)
+            keys.push_back(key);
+        return keys;
+    }
+
+    /// If a body younger than max_age is stored for key, call f with a
+    /// view of it (only valid during the call) and return true.
+    template<class F>
+    bool find (std::string const& key, clock::duration max_age, F&& f) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        if (!is_open())
+            return false;
+
+        // another process may have stored it in the meanwhile
+        auto it = m_index.find(key);
+        if (it == m_index.end() && refresh(false))
+            it = m_index.find(key);
+        if (it == m_index.end())
+            return false;
+
+        auto const& entry = it->second;
+        auto const age = clock::now() - clock::time_point(
+                    std::chrono::seconds(entry.stored_at));
+        if (age > max_age)
+            return false;
+
+        if (entry.offset + entry.size > m_map_size && !remap(m_file_size))
+            return false;
+
+        f(std::string_view(m_map + entry.offset, entry.size));
+        return true;
+    }
+
+    void store (std::string const& key, std::string_view body) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        if (!is_open())
+            return;
+
+        // appended at the end of the file, after the records of the other
+        // processes, that are indexed first
+        file_lock file(*this);
+        if (!file || !refresh(true))
+            return;
+
+        record_header header{};
+        header.checksum = checksum(key, body);
+        header.key_size = key.size();
+        header.body_size = body.size();
+        header.stored_at = std::chrono::duration_cast<std::chrono::seconds>(
+                    clock::now().time_since_epoch()).count();
+
+        std::string record;
+        record.reserve(sizeof header + key.size() + body.size());
+        record.append(reinterpret_cast<const char*>(&header), sizeof header);
+        record.append(key);
+        record.append(body);
+
+        auto const offset = m_file_size;
+        if (!append(record.data(), record.size()))
+            return;
+
+        m_index[key] = {offset + sizeof header + key.size(),
+                        header.body_size, header.stored_at};
+
+        if (m_file_size > m_max_size)
+            compact();
+    }
+
+private:
+    bool open () {
+        m_fd = ::open(m_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (m_fd < 0) {
+            BOOST_LOG_TRIVIAL(error)
+                    << "Unable to open response cache " << m_path
+                    << ": " << std::strerror(errno);
+            return false;
+        }
+        return true;
+    }
+
+    /// Take the exclusive lock of the file, reopening it first if another
+    /// process has replaced it (see compact).
+    bool lock_file () {
+        for (;;) {
+            int r;
+            while ((r = ::flock(m_fd, LOCK_EX)) != 0 && errno == EINTR)
+                ;
+            if (r != 0) {
+                BOOST_LOG_TRIVIAL(error)
+                        << "Unable to lock response cache: "
+                        << std::strerror(errno);
+                return false;
+            }
+
+            if (!replaced())
+                return true;
+
+            BOOST_LOG_TRIVIAL(trace)
+                    << "Response cache " << m_path << " was replaced, reopening";
+            close();
+            if (!open())
+                return false;
+        }
+    }
+
+    /// Whether the path now names another file than the one open.
+    bool replaced () const {
+        struct stat by_path, by_fd;
+        return ::stat(m_path.c_str(), &by_path) != 0
+                || ::fstat(m_fd, &by_fd) != 0
+                || by_path.st_dev != by_fd.st_dev
+                || by_path.st_ino != by_fd.st_ino;
+    }
+
+    /// Index the records appended since the last time, by any process. With
+    /// the file locked (repair), a new file gets the magic and a record only
+    /// partially written (eg: after a crash) is dropped; otherwise it may
+    /// still be in writing, and it is only left for the next time.
+    bool refresh (bool repair) {
+        // another process may have replaced the file (see compact): the one
+        // open is not written anymore. With the file locked it was already
+        // checked, and reopening would drop the lock.
+        if (!repair && replaced()) {
+            BOOST_LOG_TRIVIAL(trace)
+                    << "Response cache " << m_path << " was replaced, reopening";
+            close();
+            if (!open())
+                return false;
+        }
+
+        struct stat st;
+        if (::fstat(m_fd, &st) != 0)
+            return false;
+        std::uint64_t size = st.st_size;
+
+        // the records indexed so far are gone
+        if (size < m_file_size) {
+            m_index.clear();
+            m_file_size = 0;
+        }
+
+        if (size == 0 && repair) {
+            if (!write_all(m_fd, magic, sizeof magic, 0))
+                return false;
+            size = sizeof magic;
+        }
+
+        if (size == m_file_size)
+            return true;
+
+        if (!remap(size))
+            return false;
+
+        if (m_file_size == 0) {
+            if (size < sizeof magic || std::memcmp(m_map, magic, sizeof magic) != 0)
+                return false;
+            m_file_size = sizeof magic;
+        }
+
+        scan(size);
+
+        if (repair && m_file_size != size) {
+            BOOST_LOG_TRIVIAL(error)
+                    << "Response cache truncated at offset " << m_file_size;
+            if (::ftruncate(m_fd, m_file_size) != 0)
+                return false;
+        }
+        return true;
+    }
+
+    /// Index the records from m_file_size up to size, stopping at the first
+    /// one that is not whole.
+    void scan (std::uint64_t size) {
+        auto offset = m_file_size;
+
+        while (offset + sizeof(record_header) <= size) {
+            record_header header;
+            std::memcpy(&header, m_map + offset, sizeof header);
+
+            auto const key_offset = offset + sizeof header;
+            auto const body_offset = key_offset + header.key_size;
+            auto const end = body_offset + header.body_size;
+            if (end > size)
+                break;
+
+            std::string_view key(m_map + key_offset, header.key_size);
+            std::string_view body(m_map + body_offset, header.body_size);
+            if (checksum(key, body) != header.checksum)
+                break;
+
+            m_index[std::string(key)] =
+                    {body_offset, header.body_size, header.stored_at};
+            offset = end;
+        }
+
+        m_file_size = offset;
+    }
+
+    bool needs_compaction () const {
+        if (m_file_size > m_max_size)
+            return true;
+        return m_file_size > min_compact_size && live_size() * 2 < m_file_size;
+    }
+
+    /// Bytes of the last record of every key.
+    std::uint64_t live_size () const {
+        std::uint64_t size = sizeof magic;
+        for (auto& [key, entry] : m_index)
+            size += sizeof(record_header) + key.size() + entry.size;
+        return size;
+    }
+
+    /// Rewrite the file with the last record of every key, the most recent
+    /// first if they do not all fit, and rename it over the current one;
+    /// the file must be locked.
+    void compact () {
+        if (m_file_size > m_map_size && !remap(m_file_size))
+            return;
+
+        std::vector<std::pair<std::string const*, index_entry const*>> records;
+        records.reserve(m_index.size());
+        for (auto& [key, entry] : m_index)
+            records.emplace_back(&key, &entry);
+        std::sort(records.begin(), records.end(), [](auto const& a, auto const& b) {
+            return a.second->stored_at > b.second->stored_at;
+        });
+
+        auto const target = m_max_size / 4 * 3;
+        std::uint64_t size = sizeof magic;
+        std::size_t kept = 0;
+        for (; kept < records.size(); ++kept) {
+            auto record = sizeof(record_header) + records[kept].first->size()
+                    + records[kept].second->size;
+            if (size + record > target)
+                break;
+            size += record;
+        }
+
+        // the oldest ones first, as if they were appended in that order
+        std::string tmp = m_path + ".tmp";
+        int fd = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        bool ok = fd >= 0 && ::flock(fd, LOCK_EX) == 0
+                && write_all(fd, magic, sizeof magic, 0);
+        std::uint64_t offset = sizeof magic;
+        for (auto i = kept; ok && i > 0; --i) {
+            auto& key = *records[i - 1].first;
+            auto& entry = *records[i - 1].second;
+
+            record_header header{};
+            header.key_size = key.size();
+            header.body_size = entry.size;
+            header.stored_at = entry.stored_at;
+            std::string_view body(m_map + entry.offset, entry.size);
+            header.checksum = checksum(key, body);
+
+            ok = write_all(fd, reinterpret_cast<const char*>(&header), sizeof header, offset)
+                    && write_all(fd, key.data(), key.size(), offset + sizeof header)
+                    && write_all(fd, body.data(), body.size(),
+                                 offset + sizeof header + key.size());
+            offset += sizeof header + key.size() + body.size();
+        }
+        ok = ok && ::fsync(fd) == 0 && std::rename(tmp.c_str(), m_path.c_str()) == 0;
+
+        if (!ok) {
+            BOOST_LOG_TRIVIAL(error)
+                    << "Unable to compact response cache " << m_path
+                    << ": " << std::strerror(errno);
+            if (fd >= 0) {
+                ::unlink(tmp.c_str());
+                ::close(fd);
+            }
+            return;
+        }
+
+        BOOST_LOG_TRIVIAL(trace)
+                << "Response cache " << m_path << " compacted from "
+                << m_file_size << " to " << offset << " bytes, "
+                << records.size() - kept << " terms dropped";
+
+        // the others waiting for the old file find it replaced, and then
+        // wait for this one, that stays locked
+        close();
+        m_fd = fd;
+        refresh(true);
+    }
+
+    bool append (const char* data, std::size_t size) {
+        if (!write_all(m_fd, data, size, m_file_size)) {
+            BOOST_LOG_TRIVIAL(error)
+                    << "Unable to write response cache: "
+                    << std::strerror(errno);
+            // do not leave a torn record behind
+            if (::ftruncate(m_fd, m_file_size) != 0)
+                close();
+            return false;
+        }
+        m_file_size += size;
+        return true;
+    }
+
+    static bool write_all (int fd, const char* data, std::size_t size,
+                           std::uint64_t offset) {
+        while (size > 0) {
+            auto n = ::pwrite(fd, data, size, offset);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+            data += n;
+            size -= n;
+            offset += n;
+        }
+        return true;
+    }
+
+    bool remap (std::uint64_t size) {
+        if (m_map)
+            ::munmap(const_cast<char*>(m_map), m_map_size);
+        m_map = nullptr;
+        m_map_size = 0;
+
+        void* map = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, m_fd, 0);
+        if (map == MAP_FAILED) {
+            BOOST_LOG_TRIVIAL(error)
+                    << "Unable to map response cache: "
+                    << std::strerror(errno);
+            return false;
+        }
+
+        m_map = static_cast<const char*>(map);
+        m_map_size = size;
+        return true;
+    }
+
+    void close () {
+        if (m_map)
+            ::munmap(const_cast<char*>(m_map), m_map_size);
+        m_map = nullptr;
+        m_map_size = 0;
+        if (m_fd >= 0)
+            ::close(m_fd);
+        m_fd = -1;
+        m_file_size = 0;
+        m_index.clear();
+    }
+
+    static std::uint32_t checksum (std::string_view key, std::string_view body) {
+        // FNV-1a, only to detect torn or corrupted records
+        std::uint32_t h = 2166136261u;
+        for (auto part : {key, body})
+            for (unsigned char c : part)
+                h = (h ^ c) * 16777619u;
+        return h;
+    }
+};
+
+} // namespace dict
+
+#endif // RESPONSE_CACHE_HPP
@@ -0,0 +1,80 @@
+/**
+ * @file result_json.hpp
+ * @brief Compact JSON of the outcome of a lookup, with plain text senses
+ * @author Giuseppe Roberti <inbox> <at> <roberti> <dot> <dev>
+ */
+#ifndef RESULT_JSON_HPP
+#define RESULT_JSON_HPP
+
+#include "dict.hpp"
+#include "markup.hpp"
+
+#include <boost/json.hpp>
+
+#include <exception>
+#include <string>
+#include <string_view>
+
+namespace app {
+
+namespace json = boost::json;
+
+namespace detail {
+
+inline json::string_view to_view (std::string_view s) {
+    return {s.data(), s.size()};
+}
+
+} // namespace detail
+
+/// [{"headword": ..., "senses": [{"sn": ..., "type": ..., "text": ...}]}]
+inline json::array entries_json (dict::result const& result) {
+    json::array entries;
+    std::string text;
+
+    for (auto& entry : result.entries()) {
+        json::array senses;
+        for (auto& sense : entry.senses()) {
+            json::object s;
+            if (auto sn = sense.get_sn())
+                s["sn"] = detail::to_view(*sn);
+            s["type"] = sense.get_type();
+            text.clear();
+            markup::render_text(text, sense.get_text());
+            s["text"] = detail::to_view(text);
+            senses.push_back(std::move(s));
+        }
+
+        json::object e;
+        e["headword"] = detail::to_view(entry.get_headword());
+        e["senses"] = std::move(senses);
+        entries.push_back(std::move(e));
+    }
+
+    return entries;
+}
+
+/// {"term": ..., "entries": [...]} or {"term": ..., "suggestions": [...]};
+/// any other exception is rethrown.
+inline json::object outcome_json (std::string_view term, std::exception_ptr e,
+                                  dict::api::result_ptr const& result) {
+    json::object outcome;
+    outcome["term"] = detail::to_view(term);
+
+    try {
+        if (e)
+            std::rethrow_exception(e);
+        outcome["entries"] = entries_json(*result);
+    } catch (dict::suggestions const& suggestions) {
+        json::array array;
+        for (auto& s : suggestions)
+            array.push_back(detail::to_view(s));
+        outcome["suggestions"] = std::move(array);
+    }
+
+    return outcome;
+}
+
+} // namespace app
+
+#endif // RESULT_JSON_HPP
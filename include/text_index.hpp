@@ -0,0 +1,307 @@
+/**
+ * @file text_index.hpp
+ * @brief Inverted index of the text of the senses, for reverse lookups
+ * @author Giuseppe Roberti <inbox> <at> <roberti> <dot> <dev>
+ */
+#ifndef TEXT_INDEX_HPP
+#define TEXT_INDEX_HPP
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace dict {
+
+/// Sorted sets of document ids: the ones in both a and b are appended to
+/// out. With SSE2 four ids of a are compared with four of b at once, in
+/// all of their rotations, and the block with the smaller last id moves on.
+inline void intersect (std::vector<std::uint32_t> const& a,
+                       std::vector<std::uint32_t> const& b,
+                       std::vector<std::uint32_t>& out) {
+    std::size_t i = 0, j = 0;
+
+#if defined(__SSE2__)
+    while (i + 4 <= a.size() && j + 4 <= b.size()) {
+        auto va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a.data() + i));
+        auto vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b.data() + j));
+
+        auto eq = _mm_or_si128(
+                    _mm_or_si128(_mm_cmpeq_epi32(va, vb),
+                                 _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, 0x39))),
+                    _mm_or_si128(_mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, 0x4e)),
+                                 _mm_cmpeq_epi32(va, _mm_shuffle_epi32(vb, 0x93))));
+        auto mask = _mm_movemask_ps(_mm_castsi128_ps(eq));
+        for (int k = 0; k < 4; ++k)
+            if (mask & (1 << k))
+                out.push_back(a[i + k]);
+
+        auto last_a = a[i + 3], last_b = b[j + 3];
+        if (last_a <= last_b)
+            i += 4;
+        if (last_b <= last_a)
+            j += 4;
+    }
+#endif
+
+    while (i < a.size() && j < b.size()) {
+        if (a[i] < b[j]) {
+            ++i;
+        } else if (b[j] < a[i]) {
+            ++j;
+        } else {
+            out.push_back(a[i]);
+            ++i;
+            ++j;
+        }
+    }
+}
+
+/// Maps the words of the senses to the documents (the terms looked up)
+/// whose senses have them. Every word has a posting list of document ids,
+/// in increasing order, and of the times the word appears in each of them,
+/// stored as varint deltas; ids grow as documents are added, so adding one
+/// only appends to the lists of its words. A query is the intersection of
+/// the lists of its words, ranked by BM25. Thread-safe: searches only take
+/// a shared lock.
+class text_index {
+public:
+    struct hit {
+        std::string term;
+        double score;
+    };
+
+private:
+    static constexpr double k1 = 1.2;
+    static constexpr double b = 0.75;
+
+    struct posting_list {
+        std::vector<std::uint8_t> bytes;
+        std::uint32_t last = 0;
+        std::uint32_t count = 0;
+    };
+
+    struct decoded {
+        std::vector<std::uint32_t> docs;
+        std::vector<std::uint32_t> freqs;
+        std::size_t next = 0;
+    };
+
+    mutable std::shared_mutex m_mutex;
+    std::unordered_map<std::string, posting_list> m_postings;
+    std::unordered_map<std::string, std::uint32_t> m_ids;
+    std::vector<std::string> m_terms;
+    std::vector<std::uint32_t> m_lengths;
+    std::uint64_t m_total_length = 0;
+
+public:
+    /// Number of documents.
+    std::size_t size () const {
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        return m_terms.size();
+    }
+
+    bool contains (std::string const& term) const {
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+        return m_ids.count(term) > 0;
+    }
+
+    /// Index the texts (with Merriam-Webster tokens) of the senses of a
+    /// term, unless it was already; returns false in that case.
+    bool add (std::string const& term, std::vector<std::string_view> const& texts) {
+        // counted before taking the lock
+        std::unordered_map<std::string, std::uint32_t> freqs;
+        std::uint32_t length = 0;
+        for (auto text : texts)
+            words(text, [&](std::string&& w) {
+                ++freqs[std::move(w)];
+                ++length;
+            });
+
+        std::unique_lock<std::shared_mutex> lock(m_mutex);
+        if (term.empty() || m_ids.count(term))
+            return false;
+
+        std::uint32_t id = m_terms.size();
+        m_ids.emplace(term, id);
+        m_terms.push_back(term);
+        m_lengths.push_back(length);
+        m_total_length += length;
+
+        for (auto& [word, freq] : freqs) {
+            auto& list = m_postings[word];
+            put(list.bytes, list.count ? id - list.last : id);
+            put(list.bytes, freq);
+            list.last = id;
+            ++list.count;
+        }
+        return true;
+    }
+
+    /// The k terms whose senses have every word of the query, best first.
+    std::vector<hit> search (std::string_view query, std::size_t k) const {
+        std::vector<std::string> query_words;
+        words(query, [&](std::string&& w) {
+            if (std::find(query_words.begin(), query_words.end(), w) == query_words.end())
+                query_words.push_back(std::move(w));
+        });
+
+        std::vector<hit> hits;
+        if (query_words.empty() || k == 0)
+            return hits;
+
+        std::shared_lock<std::shared_mutex> lock(m_mutex);
+
+        // the shortest lists first, so that the candidates shrink fast
+        std::vector<posting_list const*> lists;
+        for (auto& w : query_words) {
+            auto it = m_postings.find(w);
+            if (it == m_postings.end())
+                return hits;
+            lists.push_back(&it->second);
+        }
+        std::sort(lists.begin(), lists.end(), [](auto* x, auto* y) {
+            return x->count < y->count;
+        });
+
+        std::vector<decoded> postings(lists.size());
+        for (std::size_t i = 0; i < lists.size(); ++i)
+            decode(*lists[i], postings[i]);
+
+        std::vector<std::uint32_t> docs = postings[0].docs, next;
+        for (std::size_t i = 1; i < postings.size() && !docs.empty(); ++i) {
+            next.clear();
+            intersect(docs, postings[i].docs, next);
+            docs.swap(next);
+        }
+
+        // BM25, keeping the best k in a min-heap
+        const double n = m_terms.size();
+        const double average = m_total_length / std::max(n, 1.0);
+        std::vector<double> idf;
+        for (auto* list : lists)
+            idf.push_back(std::log(1 + (n - list->count + 0.5) / (list->count + 0.5)));
+
+        using scored = std::pair<double, std::uint32_t>;
+        std::priority_queue<scored, std::vector<scored>, std::greater<scored>> best;
+        for (auto doc : docs) {
+            double score = 0;
+            double norm = k1 * (1 - b + b * m_lengths[doc] / std::max(average, 1.0));
+            for (std::size_t i = 0; i < postings.size(); ++i) {
+                // both are sorted: the lists are walked once in total
+                auto& p = postings[i];
+                while (p.docs[p.next] != doc)
+                    ++p.next;
+                double tf = p.freqs[p.next];
+                score += idf[i] * tf * (k1 + 1) / (tf + norm);
+            }
+            if (best.size() < k)
+                best.emplace(score, doc);
+            else if (score > best.top().first) {
+                best.pop();
+                best.emplace(score, doc);
+            }
+        }
+
+        hits.resize(best.size());
+        for (auto i = hits.size(); i > 0; --i) {
+            hits[i - 1] = {m_terms[best.top().second], best.top().first};
+            best.pop();
+        }
+        return hits;
+    }
+
+    /// Call f with every word of a text, in lower case: the tokens are
+    /// dropped but for the text they show (eg: {sx|word||} shows "word").
+    template<class F>
+    static void words (std::string_view text, F&& f) {
+        std::string word;
+        auto flush = [&]{
+            if (!word.empty())
+                f(std::move(word));
+            word.clear();
+        };
+        auto scan = [&](std::string_view s) {
+            for (unsigned char c : s) {
+                // bytes of UTF-8 sequences are part of words
+                if (std::isalnum(c) || c >= 0x80)
+                    word.push_back(std::tolower(c));
+                else
+                    flush();
+            }
+        };
+
+        std::size_t i = 0;
+        while (i < text.size()) {
+            auto brace = text.find('{', i);
+            auto close = brace == std::string_view::npos
+                    ? brace : text.find('}', brace);
+            if (close == std::string_view::npos) {
+                scan(text.substr(i));
+                break;
+            }
+
+            scan(text.substr(i, brace - i));
+            flush();
+
+            auto body = text.substr(brace + 1, close - brace - 1);
+            auto bar = body.find('|');
+            if (bar != std::string_view::npos) {
+                auto field = body.substr(bar + 1);
+                field = field.substr(0, field.find('|'));
+                scan(field.substr(0, field.find(':')));
+                flush();
+            }
+            i = close + 1;
+        }
+        flush();
+    }
+
+private:
+    static void put (std::vector<std::uint8_t>& out, std::uint32_t v) {
+        while (v >= 0x80) {
+            out.push_back(static_cast<std::uint8_t>(v) | 0x80);
+            v >>= 7;
+        }
+        out.push_back(static_cast<std::uint8_t>(v));
+    }
+
+    static std::uint32_t get (std::uint8_t const*& p) {
+        std::uint32_t v = 0;
+        for (unsigned shift = 0;; shift += 7) {
+            auto byte = *p++;
+            v |= std::uint32_t(byte & 0x7f) << shift;
+            if (!(byte & 0x80))
+                return v;
+        }
+    }
+
+    static void decode (posting_list const& list, decoded& out) {
+        out.docs.resize(list.count);
+        out.freqs.resize(list.count);
+        auto p = list.bytes.data();
+        std::uint32_t doc = 0;
+        for (std::uint32_t i = 0; i < list.count; ++i) {
+            doc += get(p);
+            out.docs[i] = doc;
+            out.freqs[i] = get(p);
+        }
+    }
+};
+
+} // namespace dict
+
+#endif // TEXT_INDEX_HPP
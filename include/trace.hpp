@@ -0,0 +1,284 @@
+/**
+ * @file trace.hpp
+ * @brief Per-thread binary trace ring buffers, exported as Chrome trace JSON
+ * @author Giuseppe Roberti <inbox> <at> <roberti> <dot> <dev>
+ */
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace dict {
+namespace trace {
+
+using clock = std::chrono::steady_clock;
+
+/// A fixed-size record: names are string literals, so nothing is formatted
+/// nor allocated while tracing.
+struct event {
+    const char* name;
+    const char* arg_name;   ///< nullptr if there is no argument
+    std::int64_t arg;
+    std::uint64_t ts;       ///< ns, on the steady clock
+    std::uint64_t dur;      ///< ns, for spans
+    char ph;                ///< 'X' span, 'i' instant
+};
+
+/// The events of a single thread: only that thread writes, and once full
+/// the oldest events are overwritten. Readers copy the events and then
+/// drop the ones that were overwritten in the meanwhile.
+class ring {
+public:
+    static constexpr std::size_t capacity = 1 << 13;
+
+private:
+    std::array<event, capacity> m_events;
+    std::atomic<std::uint64_t> m_head{0};
+    const std::uint32_t m_tid;
+    std::atomic<const char*> m_thread_name{nullptr};
+
+public:
+    explicit ring (std::uint32_t tid):
+        m_tid(tid)
+    {}
+
+    void push (event const& e) {
+        auto head = m_head.load(std::memory_order_relaxed);
+        m_events[head & (capacity - 1)] = e;
+        m_head.store(head + 1, std::memory_order_release);
+    }
+
+    void set_thread_name (const char* name) {
+        m_thread_name.store(name, std::memory_order_relaxed);
+    }
+
+    const char* thread_name () const {
+        return m_thread_name.load(std::memory_order_relaxed);
+    }
+
+    std::uint32_t tid () const {
+        return m_tid;
+    }
+
+    void snapshot (std::vector<event>& out) const {
+        auto head = m_head.load(std::memory_order_acquire);
+        auto first = head > capacity ? head - capacity : 0;
+        auto begin = out.size();
+        for (auto i = first; i < head; ++i)
+            out.push_back(m_events[i & (capacity - 1)]);
+
+        // the writer went on meanwhile: what it overwrote, or is
+        // overwriting right now, may be torn
+        auto now = m_head.load(std::memory_order_acquire);
+        auto lost = now + 1 > capacity + first ? now + 1 - capacity - first : 0;
+        out.erase(out.begin() + begin,
+                  out.begin() + begin + std::min<std::uint64_t>(lost, head - first));
+    }
+};
+
+namespace detail {
+
+struct registry {
+    std::atomic<bool> enabled{false};
+    std::mutex mutex;
+    std::vector<std::shared_ptr<ring>> rings;
+
+    static registry& get () {
+        static registry r;
+        return r;
+    }
+};
+
+/// The ring of the calling thread, registered on first use; it outlives
+/// the thread, so that its events can still be exported.
+inline ring& local_ring () {
+    thread_local std::shared_ptr<ring> local = []{
+        auto& r = registry::get();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        r.rings.push_back(std::make_shared<ring>(r.rings.size() + 1));
+        return r.rings.back();
+    }();
+    return *local;
+}
+
+inline std::uint64_t nanos (clock::time_point t) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                t.time_since_epoch()).count();
+}
+
+inline void write_string (std::ostream& os, const char* s) {
+    os << '"';
+    for (; *s; ++s) {
+        if (*s == '"' || *s == '\\')
+            os << '\\';
+        if (static_cast<unsigned char>(*s) >= 0x20)
+            os << *s;
+    }
+    os << '"';
+}
+
+} // namespace detail
+
+/// Tracing is off until enabled: then every event costs a relaxed load.
+inline bool enabled () {
+    return detail::registry::get().enabled.load(std::memory_order_relaxed);
+}
+
+inline void enable (bool on = true) {
+    detail::registry::get().enabled.store(on, std::memory_order_relaxed);
+}
+
+/// Name the calling thread in the exported trace; name must be a literal.
+inline void set_thread_name (const char* name) {
+    if (enabled())
+        detail::local_ring().set_thread_name(name);
+}
+
+inline void span (const char* name, clock::time_point begin, clock::time_point end,
+                  const char* arg_name = nullptr, std::int64_t arg = 0) {
+    if (!enabled())
+        return;
+    auto ts = detail::nanos(begin);
+    detail::local_ring().push({name, arg_name, arg, ts, detail::nanos(end) - ts, 'X'});
+}
+
+inline void instant (const char* name, const char* arg_name = nullptr,
+                     std::int64_t arg = 0) {
+    if (!enabled())
+        return;
+    detail::local_ring().push({name, arg_name, arg,
+                               detail::nanos(clock::now()), 0, 'i'});
+}
+
+/// Records a span from its construction to its destruction.
+class scope {
+private:
+    const char* m_name;
+    const char* m_arg_name;
+    std::int64_t m_arg = 0;
+    clock::time_point m_begin;
+    const bool m_on;
+
+public:
+    explicit scope (const char* name, const char* arg_name = nullptr):
+        m_name(name)
+      , m_arg_name(arg_name)
+      , m_on(enabled())
+    {
+        if (m_on)
+            m_begin = clock::now();
+    }
+
+    scope (scope const&) = delete;
+    scope& operator= (scope const&) = delete;
+
+    ~scope () {
+        if (m_on)
+            span(m_name, m_begin, clock::now(), m_arg_name, m_arg);
+    }
+
+    void set_arg (std::int64_t arg) {
+        m_arg = arg;
+    }
+};
+
+/// Every event still in the rings, as Chrome trace JSON (chrome://tracing,
+/// ui.perfetto.dev); timestamps start from the oldest event.
+inline void write_chrome (std::ostream& os) {
+    std::vector<std::shared_ptr<ring>> rings;
+    {
+        auto& r = detail::registry::get();
+        std::lock_guard<std::mutex> lock(r.mutex);
+        rings = r.rings;
+    }
+
+    std::vector<std::vector<event>> events(rings.size());
+    std::uint64_t origin = UINT64_MAX;
+    for (std::size_t i = 0; i < rings.size(); ++i) {
+        rings[i]->snapshot(events[i]);
+        for (auto& e : events[i])
+            origin = std::min(origin, e.ts);
+    }
+
+    os << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    bool first = true;
+    auto separator = [&]{
+        if (!first)
+            os << ",";
+        first = false;
+        os << "\n";
+    };
+
+    auto flags = os.flags();
+    os.setf(std::ios::fixed);
+    auto precision = os.precision(3);
+
+    for (std::size_t i = 0; i < rings.size(); ++i) {
+        auto tid = rings[i]->tid();
+        if (auto name = rings[i]->thread_name()) {
+            separator();
+            os << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << tid
+               << ",\"args\":{\"name\":";
+            detail::write_string(os, name);
+            os << "}}";
+        }
+
+        for (auto& e : events[i]) {
+            separator();
+            os << "{\"name\":";
+            detail::write_string(os, e.name);
+            os << ",\"ph\":\"" << e.ph << "\",\"pid\":1,\"tid\":" << tid
+               << ",\"ts\":" << (e.ts - origin) / 1000.0;
+            if (e.ph == 'X')
+                os << ",\"dur\":" << e.dur / 1000.0;
+            else
+                os << ",\"s\":\"t\"";
+            if (e.arg_name) {
+                os << ",\"args\":{";
+                detail::write_string(os, e.arg_name);
+                os << ":" << e.arg << "}";
+            }
+            os << "}";
+        }
+    }
+
+    os << "\n]}\n";
+    os.flags(flags);
+    os.precision(precision);
+}
+
+inline bool write_chrome (std::string const& path) {
+    std::ofstream out(path);
+    write_chrome(out);
+    return static_cast<bool>(out);
+}
+
+} // namespace trace
+} // namespace dict
+
+#define DICT_TRACE_CONCAT_(a, b) a##b
+#define DICT_TRACE_CONCAT(a, b) DICT_TRACE_CONCAT_(a, b)
+
+#ifndef DICT_NO_TRACE
+/// A span named name (a string literal) until the end of the block.
+#define DICT_TRACE_SCOPE(name) \
+    ::dict::trace::scope DICT_TRACE_CONCAT(dict_trace_scope_, __LINE__)(name)
+/// A point in time named name, with an integer argument.
+#define DICT_TRACE_INSTANT(name, arg_name, arg) \
+    ::dict::trace::instant(name, arg_name, static_cast<std::int64_t>(arg))
+#else
+#define DICT_TRACE_SCOPE(name) ((void) 0)
+#define DICT_TRACE_INSTANT(name, arg_name, arg) ((void) 0)
+#endif
+
+#endif // TRACE_HPP
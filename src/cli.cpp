@@ -0,0 +1,207 @@
+/**
+ * @file cli.cpp
+ * @brief Headless Dictionary, looking up many terms in parallel
+ * @author Giuseppe Roberti <inbox> <at> <roberti> <dot> <dev>
+ */
+#include "dict.hpp"
+#include "markup.hpp"
+#include "result_json.hpp"
+
+#include <boost/json.hpp>
+#include <boost/log/core.hpp>
+#include <boost/log/expressions.hpp>
+
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace logging = boost::log;
+namespace json = boost::json;
+
+namespace {
+
+void usage () {
+    std::cerr <<
+        "Usage: dictionary-cli [options] [FILE]\n"
+        "Lookup the terms in FILE (or the standard input), one per line.\n"
+        "  -j, --jobs N       lookups in flight at once (8)\n"
+        "  --json             write a JSON object per term (JSON lines)\n"
+        "  --offline          only lookup terms in the response cache\n"
+        "  --compiled FILE    lookup terms in a compiled dictionary first\n"
+        "  --references LIST  references looked up at once, their entries merged,\n"
+        "                     eg: collegiate,thesaurus:KEY@800 (a name, its key\n"
+        "                     and its deadline in milliseconds, if any)\n"
+        "  --metrics FILE     write the lookup metrics, in the Prometheus text\n"
+        "                     format, to FILE (- for the standard error)\n"
+        "  --trace FILE       record a trace of the lookups and write it to FILE,\n"
+        "                     as Chrome trace JSON (ui.perfetto.dev)\n";
+}
+
+/// Plain text: the term, then every entry with its headword and senses.
+std::string to_text (std::string const& term, std::exception_ptr e,
+                     dict::api::result_ptr const& result) {
+    std::string out = term + "\n";
+
+    try {
+        if (e)
+            std::rethrow_exception(e);
+
+        for (auto& entry : result->entries()) {
+            out += "  " + entry.get_headword() + "\n";
+            for (auto& sense : entry.senses()) {
+                app::markup::render_sense_text(out, sense);
+                out += "\n";
+            }
+        }
+    } catch (dict::suggestions const& suggestions) {
+        out += "  not found, did you mean:";
+        for (auto& s : suggestions)
+            out += " " + s;
+        out += "\n";
+    }
+
+    return out;
+}
+
+/// Replace the file at once, so that a collector never reads half of it.
+bool write_metrics (dict::api const& api, std::string const& path) {
+    if (path == "-") {
+        api.write_prometheus(std::cerr);
+        return true;
+    }
+
+    auto tmp = path + ".tmp";
+    {
+        std::ofstream out(tmp);
+        api.write_prometheus(out);
+        if (!out)
+            return false;
+    }
+    return std::rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+/// One line of JSON with the term and its entries, or its suggestions.
+std::string to_json (std::string const& term, std::exception_ptr e,
+                     dict::api::result_ptr const& result) {
+    return json::serialize(app::outcome_json(term, e, result)) + "\n";
+}
+
+} // namespace
+
+int main (int argc, char* argv[]) {
+    logging::core::get()->set_filter
+    (
+        logging::trivial::severity >=
+                logging::trivial::severity_level::error
+    );
+
+    std::size_t jobs = 8;
+    bool as_json = false;
+    auto options = dict::api_options::from_env();
+    std::optional<std::string> file;
+    std::string metrics, trace;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if ((arg == "-j" || arg == "--jobs") && i + 1 < argc) {
+            jobs = std::max<std::size_t>(1, std::strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--json") {
+            as_json = true;
+        } else if (arg == "--offline") {
+            options.offline = true;
+        } else if (arg == "--compiled" && i + 1 < argc) {
+            options.compiled = argv[++i];
+        } else if (arg == "--references" && i + 1 < argc) {
+            auto references = dict::api_options::parse_references(argv[++i]);
+            if (!references.empty())
+                options.references = std::move(references);
+        } else if (arg == "--metrics" && i + 1 < argc) {
+            metrics = argv[++i];
+        } else if (arg == "--trace" && i + 1 < argc) {
+            trace = argv[++i];
+        } else if (arg == "-h" || arg == "--help") {
+            usage();
+            return 0;
+        } else if (!file && arg != "-") {
+            file = arg;
+        } else if (arg != "-") {
+            usage();
+            return 1;
+        }
+    }
+
+    std::ifstream in;
+    if (file) {
+        in.open(*file);
+        if (!in) {
+            std::cerr << "Unable to open " << *file << "\n";
+            return 1;
+        }
+    }
+
+    std::vector<std::string> terms;
+    for (std::string line; std::getline(file ? in : std::cin, line);) {
+        auto term = dict::normalize(line);
+        if (!term.empty())
+            terms.push_back(std::move(term));
+    }
+
+    auto* key = std::getenv("DICTIONARY_API_KEY");
+    std::size_t failed = 0;
+
+    if (!trace.empty()) {
+        dict::trace::enable();
+        dict::trace::set_thread_name("main");
+    }
+
+    try {
+        dict::api api(key ? key : "", options);
+
+        // outcomes come in any order, but are written in the input one:
+        // the same term may appear more than once, with the same outcome
+        std::vector<std::optional<std::string>> outputs(terms.size());
+        std::unordered_map<std::string, std::deque<std::size_t>> pending;
+        for (std::size_t i = 0; i < terms.size(); ++i)
+            pending[terms[i]].push_back(i);
+        std::size_t written = 0;
+
+        api.request_many(terms, jobs,
+                         [&](std::string const& term, std::exception_ptr e,
+                             dict::api::result_ptr result) {
+            auto& indexes = pending[term];
+            auto i = indexes.front();
+            indexes.pop_front();
+
+            try {
+                outputs[i] = as_json ? to_json(term, e, result)
+                                     : to_text(term, e, result);
+            } catch (std::exception const& ex) {
+                ++failed;
+                std::cerr << term << ": " << ex.what() << "\n";
+                outputs[i].emplace();
+            }
+
+            for (; written < outputs.size() && outputs[written]; ++written) {
+                std::cout << *outputs[written];
+                outputs[written].emplace();
+            }
+            std::cout.flush();
+        });
+
+        if (!metrics.empty() && !write_metrics(api, metrics))
+            std::cerr << "Unable to write " << metrics << "\n";
+        if (!trace.empty() && !dict::trace::write_chrome(trace))
+            std::cerr << "Unable to write " << trace << "\n";
+    } catch (std::exception const& e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+
+    return failed ? 2 : 0;
+}
@@ -0,0 +1,257 @@
+/**
+ * @file compile.cpp
+ * @brief Compiler of bulk exports of responses into a compiled dictionary
+ * @author Giuseppe Roberti <inbox> <at> <roberti> <dot> <dev>
+ */
+#include "dict.hpp"
+
+#include <boost/json.hpp>
+#include <boost/log/core.hpp>
+#include <boost/log/expressions.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace logging = boost::log;
+namespace json = boost::json;
+
+namespace {
+
+using entry_data = dict::compiled_dict_writer::entry_data;
+
+void usage () {
+    std::cerr <<
+        "Usage: dictionary-compile [options] INPUT OUTPUT\n"
+        "Compile a bulk export of responses, one JSON per line, into a\n"
+        "dictionary to be mapped by DICTIONARY_COMPILED. A line is either a\n"
+        "response (an array of entries, indexed by their headwords) or an\n"
+        "object {\"term\": ..., \"response\": [...]}, indexed by the term too.\n"
+        "  -j, --jobs N       lines parsed in parallel by N threads (one per core)\n";
+}
+
+/// The entries of a line, as a result sees them.
+struct record {
+    std::string term;
+    std::vector<entry_data> entries;
+};
+
+struct chunk {
+    std::vector<record> records;
+    std::size_t lines = 0;
+    std::size_t skipped = 0;
+};
+
+bool parse_line (std::string_view line, record& out) {
+    boost::system::error_code ec;
+    auto value = json::parse(json::string_view(line.data(), line.size()), ec);
+    if (ec)
+        return false;
+
+    if (auto* object = value.if_object()) {
+        auto* term = object->if_contains("term");
+        auto* response = object->if_contains("response");
+        if (!term || !term->is_string() || !response)
+            return false;
+        auto& t = term->get_string();
+        out.term = dict::normalize(std::string_view(t.data(), t.size()));
+        value = std::move(*response);
+    }
+    if (!value.is_array())
+        return false;
+
+    // the same parsing of a response received from the service: the
+    // entries without definitions, and the suggestions, are dropped
+    dict::result result(std::move(value));
+    for (auto& e : result.entries()) {
+        if (e.senses().empty())
+            continue;
+        entry_data entry;
+        entry.headword = e.get_headword();
+        entry.fl.assign(e.get_fl());
+        for (auto& s : e.senses()) {
+            auto& sense = entry.senses.emplace_back();
+            sense.type = static_cast<std::uint32_t>(s.get_type_id());
+            if (auto sn = s.get_sn())
+                sense.sn.emplace(*sn);
+            sense.text.assign(s.get_text());
+        }
+        out.entries.push_back(std::move(entry));
+    }
+    return true;
+}
+
+void parse_chunk (std::string_view text, chunk& out) {
+    while (!text.empty()) {
+        auto end = std::min(text.find('\n'), text.size());
+        auto line = text.substr(0, end);
+        text.remove_prefix(std::min(end + 1, text.size()));
+
+        if (line.find_first_not_of(" \t\r") == std::string_view::npos)
+            continue;
+        ++out.lines;
+
+        record r;
+        try {
+            if (!parse_line(line, r)) {
+                ++out.skipped;
+                continue;
+            }
+        } catch (std::exception const&) {
+            ++out.skipped;
+            continue;
+        }
+        if (!r.entries.empty())
+            out.records.push_back(std::move(r));
+    }
+}
+
+/// Every key with the entries it gets: the term of a record gets all of
+/// them, like the service would answer, and a headword the entries that
+/// have it, unless that key was already taken; the first record wins.
+void add_terms (std::vector<chunk> const& chunks, dict::compiled_dict_writer& writer) {
+    struct source {
+        record const* rec;
+        std::vector<std::uint32_t> entries;    // indices in rec->entries
+    };
+    std::unordered_map<std::string, std::size_t> index;
+    std::vector<std::pair<std::string, source>> keys;
+
+    auto take = [&](std::string key, source src) {
+        if (key.empty() || !index.emplace(key, keys.size()).second)
+            return;
+        keys.emplace_back(std::move(key), std::move(src));
+    };
+
+    for (auto& c : chunks)
+        for (auto& r : c.records) {
+            if (r.term.empty())
+                continue;
+            source src{&r, {}};
+            for (std::uint32_t i = 0; i < r.entries.size(); ++i)
+                src.entries.push_back(i);
+            take(r.term, std::move(src));
+        }
+
+    for (auto& c : chunks)
+        for (auto& r : c.records) {
+            std::vector<std::pair<std::string, source>> groups;
+            for (std::uint32_t i = 0; i < r.entries.size(); ++i) {
+                auto key = dict::normalize(r.entries[i].headword);
+                auto it = std::find_if(groups.begin(), groups.end(),
+                                       [&](auto& g) { return g.first == key; });
+                if (it == groups.end())
+                    it = groups.insert(groups.end(), {key, source{&r, {}}});
+                it->second.entries.push_back(i);
+            }
+            for (auto& [key, src] : groups)
+                take(std::move(key), std::move(src));
+        }
+
+    // an entry is stored once, however many keys refer to it
+    std::unordered_map<entry_data const*, std::uint32_t> stored;
+    for (auto& [key, src] : keys) {
+        std::vector<std::uint32_t> entries;
+        for (auto i : src.entries) {
+            auto& e = src.rec->entries[i];
+            auto it = stored.find(&e);
+            if (it == stored.end())
+                it = stored.emplace(&e, writer.add_entry(e)).first;
+            entries.push_back(it->second);
+        }
+        writer.add_term(key, std::move(entries));
+    }
+}
+
+} // namespace
+
+int main (int argc, char* argv[]) {
+    logging::core::get()->set_filter
+    (
+        logging::trivial::severity >=
+                logging::trivial::severity_level::error
+    );
+
+    unsigned jobs = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::string> paths;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if ((arg == "-j" || arg == "--jobs") && i + 1 < argc) {
+            jobs = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "-h" || arg == "--help") {
+            usage();
+            return 0;
+        } else {
+            paths.push_back(arg);
+        }
+    }
+
+    if (paths.size() != 2) {
+        usage();
+        return 1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    std::ifstream in(paths[0], std::ios::binary);
+    if (!in) {
+        std::cerr << "Unable to open " << paths[0] << "\n";
+        return 1;
+    }
+    std::string text(std::istreambuf_iterator<char>(in), {});
+
+    // a chunk of whole lines per thread, parsed in parallel and then
+    // merged in the order of the input
+    std::vector<std::string_view> parts;
+    std::string_view rest = text;
+    for (unsigned i = jobs; i > 0 && !rest.empty(); --i) {
+        auto size = i == 1 ? rest.size() : rest.size() / i;
+        auto end = rest.find('\n', size);
+        end = end == std::string_view::npos ? rest.size() : end + 1;
+        parts.push_back(rest.substr(0, end));
+        rest.remove_prefix(end);
+    }
+
+    std::vector<chunk> chunks(parts.size());
+    std::vector<std::thread> threads;
+    for (std::size_t i = 0; i < parts.size(); ++i)
+        threads.emplace_back([&, i]{ parse_chunk(parts[i], chunks[i]); });
+    for (auto& t : threads)
+        t.join();
+
+    std::size_t lines = 0, skipped = 0;
+    for (auto& c : chunks) {
+        lines += c.lines;
+        skipped += c.skipped;
+    }
+
+    dict::compiled_dict_writer writer;
+    add_terms(chunks, writer);
+    if (!writer.write(paths[1])) {
+        std::cerr << "Unable to write " << paths[1] << "\n";
+        return 1;
+    }
+
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - start);
+    std::cerr << "Compiled " << writer.size() << " terms, "
+              << writer.entry_count() << " entries and "
+              << writer.sense_count() << " senses from " << lines
+              << " lines in " << elapsed.count() << " ms with "
+              << parts.size() << " threads";
+    if (skipped)
+        std::cerr << " (" << skipped << " lines skipped)";
+    std::cerr << "\n";
+
+    return skipped ? 2 : 0;
+}
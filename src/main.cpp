@@ -17,11 +17,23 @@ int main (int argc, char* argv[])
         logging::trivial::severity >=
                 logging::trivial::severity_level::error
     );
+
+    // DICTIONARY_TRACE=FILE records a trace, written to FILE on exit
+    auto trace = Glib::getenv("DICTIONARY_TRACE");
+    if (!trace.empty()) {
+        dict::trace::enable();
+        dict::trace::set_thread_name("gtk");
+    }
+
     const Glib::ustring app_id =
             "dev.roberti.udacity.cppnd.final-project";
     const Glib::ustring title = "Dictionary";
     const int width = 800, height = 800;
     auto app = Gtk::Application::create(app_id);
-    return app->make_window_and_run<app::Window>
+    auto status = app->make_window_and_run<app::Window>
             (argc, argv, title, width, height);
+
+    if (!trace.empty())
+        dict::trace::write_chrome(trace.raw());
+    return status;
 }
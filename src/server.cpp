@@ -0,0 +1,304 @@
+/**
+ * @file server.cpp
+ * @brief Local HTTP lookup service sharing a single dict::api
+ * @author Giuseppe Roberti <inbox> <at> <roberti> <dot> <dev>
+ */
+#include "dict.hpp"
+#include "result_json.hpp"
+
+#include <boost/asio.hpp>
+#include <boost/beast.hpp>
+#include <boost/json.hpp>
+#include <boost/log/core.hpp>
+#include <boost/log/expressions.hpp>
+#include <boost/log/trivial.hpp>
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace logging = boost::log;
+
+namespace {
+
+namespace beast = boost::beast;
+namespace system = boost::system;
+namespace http = boost::beast::http;
+namespace json = boost::json;
+namespace asio = boost::asio;
+
+namespace ip = asio::ip;
+
+using tcp = ip::tcp;
+
+struct options {
+    std::string address = "127.0.0.1";
+    unsigned short port = 8080;
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    std::string trace;
+};
+
+void usage () {
+    std::cerr <<
+        "Usage: dictionary-server [options]\n"
+        "Serve GET /define/{term} with the definitions of term, as JSON,\n"
+        "and GET /metrics with the lookup metrics, for Prometheus.\n"
+        "  --address ADDR     address to listen on (127.0.0.1)\n"
+        "  --port N           port to listen on (8080)\n"
+        "  --threads N        threads serving the clients (one per core)\n"
+        "  --trace FILE       record a trace of the lookups and write it to FILE\n"
+        "                     on exit, as Chrome trace JSON (ui.perfetto.dev)\n";
+}
+
+/// Percent-decode a path segment: '+' is only a space in a query, so it is
+/// kept as it is (eg: "C++").
+bool decode (beast::string_view in, std::string& out) {
+    out.clear();
+    for (std::size_t i = 0; i < in.size(); ++i) {
+        if (in[i] == '%') {
+            if (i + 2 >= in.size() || !std::isxdigit(static_cast<unsigned char>(in[i + 1]))
+                    || !std::isxdigit(static_cast<unsigned char>(in[i + 2])))
+                return false;
+            out.push_back(static_cast<char>(
+                              std::stoi(std::string(in.substr(i + 1, 2)), nullptr, 16)));
+            i += 2;
+        } else {
+            out.push_back(in[i]);
+        }
+    }
+    return true;
+}
+
+class session : public std::enable_shared_from_this<session> {
+private:
+    static constexpr std::chrono::seconds timeout{30};
+    static constexpr char prefix[] = "/define/";
+
+    dict::api& m_api;
+    beast::tcp_stream m_stream;
+    beast::flat_buffer m_buffer;
+    http::request<http::empty_body> m_req;
+    http::response<http::string_body> m_res;
+
+public:
+    session (tcp::socket socket, dict::api& api):
+        m_api(api)
+      , m_stream(std::move(socket))
+    {}
+
+    void run () {
+        // everything of a session runs on its strand
+        asio::dispatch(m_stream.get_executor(),
+                       [self = shared_from_this()]{ self->read(); });
+    }
+
+private:
+    void read () {
+        m_req = {};
+        m_stream.expires_after(timeout);
+        http::async_read(m_stream, m_buffer, m_req,
+                    [self = shared_from_this()](system::error_code ec, std::size_t) {
+            self->on_read(ec);
+        });
+    }
+
+    void on_read (system::error_code ec) {
+        if (ec == http::error::end_of_stream)
+            return close();
+        if (ec)
+            return;
+
+        if (m_req.method() != http::verb::get)
+            return respond(http::status::method_not_allowed, error("Only GET is allowed"));
+
+        auto target = m_req.target();
+        target = target.substr(0, target.find('?'));
+
+        if (target == "/metrics") {
+            std::ostringstream oss;
+            m_api.write_prometheus(oss);
+            return respond(http::status::ok, oss.str(),
+                           "text/plain; version=0.0.4");
+        }
+
+        std::string raw;
+        if (!target.starts_with(prefix)
+                || !decode(target.substr(sizeof prefix - 1), raw))
+            return respond(http::status::not_found, error("Use GET /define/{term}"));
+
+        // no term has control characters: they are only good to forge
+        // the upstream request
+        if (std::any_of(raw.begin(), raw.end(), [](unsigned char c) {
+                return std::iscntrl(c);
+            }))
+            return respond(http::status::bad_request, error("Invalid term"));
+
+        auto term = dict::normalize(raw);
+        if (term.empty())
+            return respond(http::status::not_found, error("Use GET /define/{term}"));
+
+        // the api completes on its own thread: come back to our strand
+        m_api.async_request(term, [self = shared_from_this(), term]
+                            (std::exception_ptr e, dict::api::result_ptr result) {
+            asio::post(self->m_stream.get_executor(), [self, term, e, result]{
+                self->on_lookup(term, e, result);
+            });
+        });
+    }
+
+    void on_lookup (std::string const& term, std::exception_ptr e,
+                    dict::api::result_ptr const& result) {
+        try {
+            auto outcome = app::outcome_json(term, e, result);
+            auto status = outcome.contains("entries")
+                    ? http::status::ok : http::status::not_found;
+            respond(status, json::serialize(outcome));
+        } catch (dict::offline_miss const& ex) {
+            respond(http::status::not_found, error(ex.what(), term));
+        } catch (std::exception const& ex) {
+            respond(http::status::bad_gateway, error(ex.what(), term));
+        }
+    }
+
+    static std::string error (std::string_view message, std::string_view term = {}) {
+        json::object body;
+        if (!term.empty())
+            body["term"] = app::detail::to_view(term);
+        body["error"] = app::detail::to_view(message);
+        return json::serialize(body);
+    }
+
+    void respond (http::status status, std::string body,
+                  beast::string_view content_type = "application/json") {
+        m_res = {status, m_req.version()};
+        m_res.set(http::field::server, "dictionary-server");
+        m_res.set(http::field::content_type, content_type);
+        m_res.keep_alive(m_req.keep_alive());
+        m_res.body() = std::move(body);
+        m_res.prepare_payload();
+
+        m_stream.expires_after(timeout);
+        http::async_write(m_stream, m_res,
+                    [self = shared_from_this()](system::error_code ec, std::size_t) {
+            if (ec)
+                return;
+            if (!self->m_res.keep_alive())
+                return self->close();
+            self->read();
+        });
+    }
+
+    void close () {
+        system::error_code ec;
+        m_stream.socket().shutdown(tcp::socket::shutdown_send, ec);
+    }
+};
+
+class listener : public std::enable_shared_from_this<listener> {
+private:
+    asio::io_context& m_io_context;
+    dict::api& m_api;
+    tcp::acceptor m_acceptor;
+
+public:
+    listener (asio::io_context& io_context, dict::api& api, tcp::endpoint endpoint):
+        m_io_context(io_context)
+      , m_api(api)
+      , m_acceptor(io_context)
+    {
+        m_acceptor.open(endpoint.protocol());
+        m_acceptor.set_option(asio::socket_base::reuse_address(true));
+        m_acceptor.bind(endpoint);
+        m_acceptor.listen(asio::socket_base::max_listen_connections);
+    }
+
+    void accept () {
+        m_acceptor.async_accept(asio::make_strand(m_io_context),
+                    [self = shared_from_this()](system::error_code ec, tcp::socket socket) {
+            if (!ec)
+                std::make_shared<session>(std::move(socket), self->m_api)->run();
+            else
+                BOOST_LOG_TRIVIAL(error) << "Unable to accept: " << ec.message();
+            self->accept();
+        });
+    }
+};
+
+} // namespace
+
+int main (int argc, char* argv[]) {
+    logging::core::get()->set_filter
+    (
+        logging::trivial::severity >=
+                logging::trivial::severity_level::error
+    );
+
+    options opts;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "--address" && i + 1 < argc)
+            opts.address = argv[++i];
+        else if (arg == "--port" && i + 1 < argc)
+            opts.port = std::atoi(argv[++i]);
+        else if (arg == "--threads" && i + 1 < argc)
+            opts.threads = std::max(1, std::atoi(argv[++i]));
+        else if (arg == "--trace" && i + 1 < argc)
+            opts.trace = argv[++i];
+        else {
+            usage();
+            return arg == "-h" || arg == "--help" ? 0 : 1;
+        }
+    }
+
+    if (!opts.trace.empty())
+        dict::trace::enable();
+
+    try {
+        asio::io_context io_context(opts.threads);
+
+        // a single upstream client, with its connections and caches, is
+        // shared by every local client; it is destroyed first, so that it
+        // does not complete lookups on a destroyed io_context
+        auto* key = std::getenv("DICTIONARY_API_KEY");
+        dict::api api(key ? key : "", dict::api_options::from_env());
+
+        asio::signal_set signals(io_context, SIGINT, SIGTERM);
+        signals.async_wait([&io_context](system::error_code, int) {
+            io_context.stop();
+        });
+
+        std::make_shared<listener>(
+                    io_context, api,
+                    tcp::endpoint(ip::make_address(opts.address), opts.port))->accept();
+
+        std::cerr << "Listening on http://" << opts.address << ":" << opts.port
+                  << " with " << opts.threads << " threads\n";
+
+        std::vector<std::thread> threads;
+        for (unsigned i = 1; i < opts.threads; ++i)
+            threads.emplace_back([&io_context]{
+                dict::trace::set_thread_name("server");
+                io_context.run();
+            });
+        dict::trace::set_thread_name("server");
+        io_context.run();
+        for (auto& t : threads)
+            t.join();
+
+        if (!opts.trace.empty() && !dict::trace::write_chrome(opts.trace))
+            std::cerr << "Unable to write " << opts.trace << "\n";
+    } catch (std::exception const& e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,230 @@
+/**
+ * @file load_gen.cpp
+ * @brief Load generator driving dict::api at a given concurrency
+ * @author Giuseppe Roberti <inbox> <at> <roberti> <dot> <dev>
+ */
+#include "dict.hpp"
+
+#include <boost/log/core.hpp>
+#include <boost/log/expressions.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace logging = boost::log;
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+void usage () {
+    std::cerr <<
+        "Usage: dict_load_gen [options]\n"
+        "  --host HOST        service host (DICTIONARY_HOST or dictionaryapi.com)\n"
+        "  --port PORT        service port (DICTIONARY_PORT or https)\n"
+        "  --ca-file FILE     trust this certificate (eg: from dict_mock_server)\n"
+        "  --insecure         do not verify the server certificate\n"
+        "  --key KEY          api key (DICTIONARY_API_KEY)\n"
+        "  --terms FILE       terms to lookup, one per line, used round robin\n"
+        "  --requests N       number of lookups (1000)\n"
+        "  --concurrency N    lookups in flight at once (8)\n"
+        "  --cache            keep the response and result caches enabled\n";
+}
+
+/// Keeps `concurrency` lookups in flight; only used on the api thread.
+class driver {
+private:
+    dict::api& m_api;
+    const std::vector<std::string> m_terms;
+    const std::size_t m_requests;
+    std::size_t m_next = 0, m_done = 0, m_errors = 0, m_suggestions = 0;
+    std::vector<double> m_latencies;
+    std::promise<void> m_finished;
+
+public:
+    driver (dict::api& api, std::vector<std::string> terms, std::size_t requests):
+        m_api(api)
+      , m_terms(std::move(terms))
+      , m_requests(requests)
+    {
+        m_latencies.reserve(requests);
+    }
+
+    /// Run every lookup, blocking until they are all done.
+    void run (std::size_t concurrency) {
+        auto finished = m_finished.get_future();
+
+        boost::asio::post(m_api.get_executor(), [this, concurrency]{
+            if (m_requests == 0)
+                return m_finished.set_value();
+            for (std::size_t i = 0; i < concurrency; ++i)
+                launch();
+        });
+
+        finished.wait();
+    }
+
+    std::vector<double> const& latencies () const { return m_latencies; }
+    std::size_t errors () const { return m_errors; }
+    std::size_t suggestions () const { return m_suggestions; }
+
+private:
+    void launch () {
+        if (m_next == m_requests)
+            return;
+
+        auto const& term = m_terms[m_next++ % m_terms.size()];
+        auto begin = clock_type::now();
+
+        m_api.async_request(term, [this, begin]
+                            (std::exception_ptr e, dict::api::result_ptr) {
+            std::chrono::duration<double, std::milli> elapsed =
+                    clock_type::now() - begin;
+            m_latencies.push_back(elapsed.count());
+
+            if (e) {
+                try {
+                    std::rethrow_exception(e);
+                } catch (dict::suggestions const&) {
+                    ++m_suggestions;
+                } catch (std::exception const& ex) {
+                    if (m_errors++ == 0)
+                        std::cerr << "First error: " << ex.what() << "\n";
+                }
+            }
+
+            if (++m_done == m_requests)
+                m_finished.set_value();
+            else
+                launch();
+        });
+    }
+};
+
+double percentile (std::vector<double> const& sorted, double p) {
+    if (sorted.empty())
+        return 0;
+    auto i = static_cast<std::size_t>(p * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(i, sorted.size() - 1)];
+}
+
+} // namespace
+
+int main (int argc, char* argv[]) {
+    logging::core::get()->set_filter
+    (
+        logging::trivial::severity >=
+                logging::trivial::severity_level::error
+    );
+
+    auto options = dict::api_options::from_env();
+    auto* env_key = std::getenv("DICTIONARY_API_KEY");
+    std::string key = env_key ? env_key : "";
+    std::string terms_file;
+    std::size_t requests = 1000, concurrency = 8;
+    bool cache = false;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc) {
+                usage();
+                std::exit(1);
+            }
+            return argv[++i];
+        };
+
+        if (arg == "--host")
+            options.host = value();
+        else if (arg == "--port")
+            options.port = value();
+        else if (arg == "--ca-file")
+            options.ca_file = value();
+        else if (arg == "--insecure")
+            options.verify_peer = false;
+        else if (arg == "--key")
+            key = value();
+        else if (arg == "--terms")
+            terms_file = value();
+        else if (arg == "--requests")
+            requests = std::stoul(value());
+        else if (arg == "--concurrency")
+            concurrency = std::max<std::size_t>(1, std::stoul(value()));
+        else if (arg == "--cache")
+            cache = true;
+        else {
+            usage();
+            return arg == "--help" ? 0 : 1;
+        }
+    }
+
+    // measure the network path, unless asked otherwise
+    if (!cache) {
+        options.cache_path.clear();
+        options.offline = false;
+        options.result_cache_budget = 0;
+    }
+
+    std::vector<std::string> terms;
+    if (!terms_file.empty()) {
+        std::ifstream in(terms_file);
+        for (std::string line; std::getline(in, line);)
+            if (!line.empty())
+                terms.push_back(line);
+    }
+    if (terms.empty())
+        terms = {"no", "jet", "plot", "pet", "as is", "asdf"};
+
+    try {
+        dict::api api(key, options);
+        driver d(api, terms, requests);
+
+        auto begin = clock_type::now();
+        d.run(concurrency);
+        std::chrono::duration<double> wall = clock_type::now() - begin;
+
+        auto latencies = d.latencies();
+        std::sort(latencies.begin(), latencies.end());
+        auto pool = api.connection_stats();
+
+        std::printf("requests     %zu (%zu errors, %zu suggestions)\n",
+                    latencies.size(), d.errors(), d.suggestions());
+        std::printf("concurrency  %zu\n", concurrency);
+        std::printf("wall time    %.3f s\n", wall.count());
+        std::printf("throughput   %.1f req/s\n",
+                    wall.count() > 0 ? latencies.size() / wall.count() : 0.0);
+        std::printf("latency ms   p50 %.3f  p99 %.3f  p999 %.3f  max %.3f\n",
+                    percentile(latencies, 0.5), percentile(latencies, 0.99),
+                    percentile(latencies, 0.999),
+                    latencies.empty() ? 0.0 : latencies.back());
+        std::printf("connections  %llu hits, %llu misses, %llu reconnects, %llu resumed\n",
+                    (unsigned long long) pool.hits, (unsigned long long) pool.misses,
+                    (unsigned long long) pool.reconnects,
+                    (unsigned long long) pool.resumed);
+
+        auto& metrics = api.lookup_metrics();
+        for (auto p : {dict::phase::dns, dict::phase::connect, dict::phase::tls,
+                       dict::phase::ttfb, dict::phase::body, dict::phase::build}) {
+            auto& h = metrics[p];
+            std::printf("%-12s p50 %.3f  p99 %.3f ms (%llu)\n", dict::phase_name(p),
+                        h.percentile(0.5).count() / 1000.0,
+                        h.percentile(0.99).count() / 1000.0,
+                        (unsigned long long) h.count());
+        }
+        std::printf("bytes        %llu sent, %llu received\n",
+                    (unsigned long long) metrics.bytes_sent(),
+                    (unsigned long long) metrics.bytes_received());
+    } catch (std::exception const& e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,404 @@
+/**
+ * @file mock_server.cpp
+ * @brief Local HTTPS stand-in for dictionaryapi.com serving fixed responses
+ * @author Giuseppe Roberti <inbox> <at> <roberti> <dot> <dev>
+ */
+#include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+#include <boost/beast.hpp>
+
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+
+#ifdef DICT_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+
+namespace beast = boost::beast;
+namespace system = boost::system;
+namespace http = boost::beast::http;
+namespace asio = boost::asio;
+
+namespace ssl = asio::ssl;
+namespace ip = asio::ip;
+
+using tcp = ip::tcp;
+
+struct options {
+    std::string address = "127.0.0.1";
+    unsigned short port = 8443;
+    std::string fixtures = "bench/fixtures";
+    std::string fallback = "typical";
+    std::string cert_out;
+    std::chrono::milliseconds latency{0};
+    std::chrono::milliseconds jitter{0};
+    std::size_t chunk_size = 0;
+    bool close = false;
+    bool gzip = false;
+    unsigned threads = 1;
+};
+
+void usage () {
+    std::cerr <<
+        "Usage: dict_mock_server [options]\n"
+        "  --address ADDR     address to listen on (127.0.0.1)\n"
+        "  --port N           port to listen on (8443)\n"
+        "  --fixtures DIR     where to find <term>.json (bench/fixtures)\n"
+        "  --fallback NAME    fixture for the other terms (typical)\n"
+        "  --cert-out FILE    write the self-signed certificate, to be trusted\n"
+        "                     by the client (eg: DICTIONARY_CA_FILE)\n"
+        "  --latency MS       delay before every response (0)\n"
+        "  --jitter MS        random variation of the delay, +/- (0)\n"
+        "  --chunked N        send the body in chunks of N bytes\n"
+        "  --close            close the connection after every response\n"
+        "  --gzip             compress responses, if the client accepts gzip\n"
+        "  --threads N        threads running the server (1)\n";
+}
+
+/// A key and a self-signed certificate for localhost, only kept in memory.
+void make_certificate (ssl::context& ctx, std::string const& cert_out) {
+    std::unique_ptr<EVP_PKEY, decltype(&EVP_PKEY_free)> key(
+                EVP_EC_gen("P-256"), EVP_PKEY_free);
+    std::unique_ptr<X509, decltype(&X509_free)> cert(X509_new(), X509_free);
+    if (!key || !cert)
+        throw std::runtime_error("Unable to generate the certificate");
+
+    X509_set_version(cert.get(), 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert.get()), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert.get()), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert.get()), 60 * 60 * 24 * 30);
+    X509_set_pubkey(cert.get(), key.get());
+
+    auto name = X509_get_subject_name(cert.get());
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                               reinterpret_cast<const unsigned char*>("localhost"),
+                               -1, -1, 0);
+    X509_set_issuer_name(cert.get(), name);
+
+    X509V3_CTX v3;
+    X509V3_set_ctx_nodb(&v3);
+    X509V3_set_ctx(&v3, cert.get(), cert.get(), nullptr, nullptr, 0);
+    for (auto [nid, value] : {std::pair{NID_subject_alt_name, "DNS:localhost,IP:127.0.0.1"},
+                              std::pair{NID_basic_constraints, "critical,CA:TRUE"}}) {
+        auto ext = X509V3_EXT_conf_nid(nullptr, &v3, nid, value);
+        X509_add_ext(cert.get(), ext, -1);
+        X509_EXTENSION_free(ext);
+    }
+
+    if (!X509_sign(cert.get(), key.get(), EVP_sha256())
+            || !SSL_CTX_use_certificate(ctx.native_handle(), cert.get())
+            || !SSL_CTX_use_PrivateKey(ctx.native_handle(), key.get()))
+        throw std::runtime_error("Unable to sign the certificate");
+
+    if (!cert_out.empty()) {
+        auto file = std::fopen(cert_out.c_str(), "w");
+        if (!file || !PEM_write_X509(file, cert.get()))
+            throw std::runtime_error("Unable to write " + cert_out);
+        std::fclose(file);
+    }
+}
+
+#ifdef DICT_HAVE_ZLIB
+std::string gzip (std::string const& in) {
+    z_stream zs{};
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+        throw std::runtime_error("Unable to compress");
+
+    std::string out(deflateBound(&zs, in.size()), '\0');
+    zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+    zs.avail_in = in.size();
+    zs.next_out = reinterpret_cast<Bytef*>(out.data());
+    zs.avail_out = out.size();
+    deflate(&zs, Z_FINISH);
+    out.resize(zs.total_out);
+    deflateEnd(&zs);
+    return out;
+}
+#endif
+
+class fixtures {
+private:
+    const std::string m_dir, m_fallback;
+
+public:
+    fixtures (std::string dir, std::string fallback):
+        m_dir(std::move(dir)), m_fallback(std::move(fallback))
+    {}
+
+    /// The fixture named like the last segment of the target, or the fallback.
+    std::string body (beast::string_view target) const {
+        auto path = target.substr(0, target.find('?'));
+        auto term = std::string(path.substr(path.rfind('/') + 1));
+
+        std::string body;
+        if (term.find("..") == std::string::npos && read(term, body))
+            return body;
+        read(m_fallback, body);
+        return body;
+    }
+
+private:
+    bool read (std::string const& name, std::string& body) const {
+        std::ifstream in(m_dir + "/" + name + ".json");
+        if (!in)
+            return false;
+        std::ostringstream oss;
+        oss << in.rdbuf();
+        body = oss.str();
+        return true;
+    }
+};
+
+class session : public std::enable_shared_from_this<session> {
+private:
+    options const& m_options;
+    fixtures const& m_fixtures;
+    ssl::stream<beast::tcp_stream> m_stream;
+    beast::flat_buffer m_buffer;
+    asio::steady_timer m_timer;
+    http::request<http::empty_body> m_req;
+
+    // the response, either whole or a chunk at a time
+    http::response<http::string_body> m_res;
+    http::response<http::empty_body> m_header;
+    std::unique_ptr<http::response_serializer<http::empty_body>> m_serializer;
+    std::size_t m_sent = 0;
+
+public:
+    session (tcp::socket socket, ssl::context& ctx,
+             options const& options, fixtures const& fixtures):
+        m_options(options)
+      , m_fixtures(fixtures)
+      , m_stream(std::move(socket), ctx)
+      , m_timer(m_stream.get_executor())
+    {}
+
+    void run () {
+        m_stream.async_handshake(ssl::stream_base::server,
+                    [self = shared_from_this()](system::error_code ec) {
+            if (!ec)
+                self->read();
+        });
+    }
+
+private:
+    void read () {
+        m_req = {};
+        http::async_read(m_stream, m_buffer, m_req,
+                    [self = shared_from_this()](system::error_code ec, std::size_t) {
+            self->on_read(ec);
+        });
+    }
+
+    void on_read (system::error_code ec) {
+        if (ec)
+            return shutdown();
+
+        m_timer.expires_after(delay());
+        m_timer.async_wait([self = shared_from_this()](system::error_code) {
+            self->respond();
+        });
+    }
+
+    std::chrono::milliseconds delay () const {
+        thread_local std::mt19937 random{std::random_device{}()};
+
+        auto jitter = m_options.jitter.count();
+        std::uniform_int_distribution<long> dist(-jitter, jitter);
+        return std::max(std::chrono::milliseconds(0),
+                        m_options.latency + std::chrono::milliseconds(dist(random)));
+    }
+
+    void respond () {
+        m_res = {http::status::ok, m_req.version()};
+        m_res.set(http::field::server, "dict_mock_server");
+        m_res.set(http::field::content_type, "application/json");
+        m_res.keep_alive(m_req.keep_alive() && !m_options.close);
+        m_res.body() = m_fixtures.body(m_req.target());
+
+#ifdef DICT_HAVE_ZLIB
+        auto accept = m_req[http::field::accept_encoding];
+        if (m_options.gzip && accept.find("gzip") != beast::string_view::npos) {
+            m_res.body() = gzip(m_res.body());
+            m_res.set(http::field::content_encoding, "gzip");
+        }
+#endif
+
+        if (m_options.chunk_size > 0)
+            return write_header();
+
+        m_res.prepare_payload();
+        http::async_write(m_stream, m_res,
+                    [self = shared_from_this()](system::error_code ec, std::size_t) {
+            self->on_write(ec);
+        });
+    }
+
+    void write_header () {
+        m_header = {http::status::ok, m_req.version()};
+        m_header.base() = m_res.base();
+        m_header.chunked(true);
+        m_serializer = std::make_unique<http::response_serializer<http::empty_body>>(m_header);
+        m_sent = 0;
+
+        http::async_write_header(m_stream, *m_serializer,
+                    [self = shared_from_this()](system::error_code ec, std::size_t) {
+            if (ec)
+                return self->shutdown();
+            self->write_chunk();
+        });
+    }
+
+    void write_chunk () {
+        auto& body = m_res.body();
+        auto done = [self = shared_from_this()](system::error_code ec, std::size_t) {
+            if (ec)
+                return self->shutdown();
+            self->write_chunk();
+        };
+
+        if (m_sent < body.size()) {
+            auto n = std::min(m_options.chunk_size, body.size() - m_sent);
+            auto chunk = asio::buffer(body.data() + m_sent, n);
+            m_sent += n;
+            asio::async_write(m_stream, http::make_chunk(chunk), std::move(done));
+        } else if (m_serializer) {
+            m_serializer.reset();
+            asio::async_write(m_stream, http::make_chunk_last(),
+                        [self = shared_from_this()](system::error_code ec, std::size_t) {
+                self->on_write(ec);
+            });
+        }
+    }
+
+    void on_write (system::error_code ec) {
+        if (ec || !m_res.keep_alive())
+            return shutdown();
+        read();
+    }
+
+    void shutdown () {
+        m_stream.async_shutdown([self = shared_from_this()](system::error_code) {
+            system::error_code ec;
+            beast::get_lowest_layer(self->m_stream).socket().close(ec);
+        });
+    }
+};
+
+class listener : public std::enable_shared_from_this<listener> {
+private:
+    asio::io_context& m_io_context;
+    ssl::context& m_ssl_context;
+    options const& m_options;
+    fixtures const& m_fixtures;
+    tcp::acceptor m_acceptor;
+
+public:
+    listener (asio::io_context& io_context, ssl::context& ssl_context,
+              options const& options, fixtures const& fixtures):
+        m_io_context(io_context)
+      , m_ssl_context(ssl_context)
+      , m_options(options)
+      , m_fixtures(fixtures)
+      , m_acceptor(io_context, {ip::make_address(options.address), options.port})
+    {}
+
+    void accept () {
+        m_acceptor.async_accept(asio::make_strand(m_io_context),
+                    [self = shared_from_this()](system::error_code ec, tcp::socket socket) {
+            if (!ec)
+                std::make_shared<session>(std::move(socket), self->m_ssl_context,
+                                          self->m_options, self->m_fixtures)->run();
+            self->accept();
+        });
+    }
+};
+
+} // namespace
+
+int main (int argc, char* argv[]) {
+    options opts;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto value = [&]() -> std::string {
+            if (i + 1 >= argc) {
+                usage();
+                std::exit(1);
+            }
+            return argv[++i];
+        };
+
+        if (arg == "--address")
+            opts.address = value();
+        else if (arg == "--port")
+            opts.port = std::stoi(value());
+        else if (arg == "--fixtures")
+            opts.fixtures = value();
+        else if (arg == "--fallback")
+            opts.fallback = value();
+        else if (arg == "--cert-out")
+            opts.cert_out = value();
+        else if (arg == "--latency")
+            opts.latency = std::chrono::milliseconds(std::stol(value()));
+        else if (arg == "--jitter")
+            opts.jitter = std::chrono::milliseconds(std::stol(value()));
+        else if (arg == "--chunked")
+            opts.chunk_size = std::stoul(value());
+        else if (arg == "--close")
+            opts.close = true;
+#ifdef DICT_HAVE_ZLIB
+        else if (arg == "--gzip")
+            opts.gzip = true;
+#endif
+        else if (arg == "--threads")
+            opts.threads = std::max(1, std::stoi(value()));
+        else {
+            usage();
+            return arg == "--help" ? 0 : 1;
+        }
+    }
+
+    try {
+        ssl::context ssl_context(ssl::context::tls_server);
+        make_certificate(ssl_context, opts.cert_out);
+
+        fixtures fixtures(opts.fixtures, opts.fallback);
+        asio::io_context io_context(opts.threads);
+
+        std::make_shared<listener>(io_context, ssl_context, opts, fixtures)->accept();
+
+        std::cerr << "Listening on https://" << opts.address << ":" << opts.port
+                  << " with " << opts.threads << " threads\n";
+
+        std::vector<std::thread> threads;
+        for (unsigned i = 1; i < opts.threads; ++i)
+            threads.emplace_back([&io_context]{ io_context.run(); });
+        io_context.run();
+        for (auto& t : threads)
+            t.join();
+    } catch (std::exception const& e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+
+    return 0;
+}